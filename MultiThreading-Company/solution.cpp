@@ -3,6 +3,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstdint>
+#include <cstddef>
 #include <climits>
 #include <cfloat>
 #include <cmath>
@@ -26,8 +27,12 @@
 #include <semaphore>
 #include <atomic>
 #include <condition_variable>
+#include <cstring>
+#include <string>
+#include <random>
 #include "progtest_solver.h"
 #include "sample_tester.h"
+#include "trace_replay.h"
 
 #endif /* __PROGTEST__ */
 
@@ -40,13 +45,128 @@ struct trackMaterialID {
 
 using orderItem = std::pair<AOrderList, ACustomer>;
 
+struct CostKey {
+    unsigned w;
+    unsigned h;
+    double weld;
+
+    bool operator==(const CostKey &o) const { return w == o.w && h == o.h && weld == o.weld; }
+};
+
+struct CostKeyHash {
+    std::size_t operator()(const CostKey &k) const {
+        return std::hash<unsigned>()(k.w) ^ (std::hash<unsigned>()(k.h) << 1) ^ (std::hash<double>()(k.weld) << 2);
+    }
+};
+
+// solved orders of one material, valid while the catalogue stays at `version`
+struct CostTable {
+    uint64_t version = 0;
+    std::unordered_map<CostKey, double, CostKeyHash> entries;
+};
+
+enum class AdmissionPolicy {
+    ADMIT,      // solve everything
+    REJECT,     // complete over-budget order lists right away with DBL_MAX costs
+    DEFER       // solve over-budget order lists only when no regular work is queued
+};
+
+struct ThrottleStats {
+    size_t receiverWaits;   // receiver thread paused before waitForDemand (order/waiting queue full)
+    size_t completedWaits;  // worker paused because completedOrders was full
+    size_t rejected;
+    size_t deferred;
+};
+
+// ------------------- Snapshot file layout -------------------
+// header, then materialCount x (SnapshotMaterial + prodCount x SnapshotProd),
+// then tableCount x (SnapshotTable + entryCount x SnapshotCost)
+constexpr char SNAPSHOT_MAGIC[8] = {'W', 'E', 'L', 'D', 'S', 'N', 'P', '1'};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t materialCount;
+    uint32_t tableCount;
+};
+
+struct SnapshotMaterial {
+    uint32_t materialID;
+    uint32_t prodCount;
+    uint64_t version;
+};
+
+struct SnapshotProd {
+    uint32_t w;
+    uint32_t h;
+    double cost;
+};
+
+struct SnapshotTable {
+    uint32_t materialID;
+    uint32_t entryCount;
+    uint64_t version;
+};
+
+struct SnapshotCost {
+    uint32_t w;
+    uint32_t h;
+    double weld;
+    double cost;
+};
+
 // ------------------- MySolver -------------------
 class Mysolver {
 public:
     static double calculatePrice(const APriceList &priceList, int w, int h,
                                  double weldStrength, unsigned int threadCount = 1);
 
+    // generic top-down DP over every width/height, the reference the specialized paths must agree with
+    static double memoPrice(const APriceList &priceList, int w, int h, double weldStrength);
+
 private:
+    static constexpr int SMALL_DIM = 16;
+    static constexpr int MEDIUM_DIM = 32;
+    // integral prices below 2^40 keep every sum of a <= 32x32 plate far below CostTraits<int64_t>::INF
+    static constexpr double INT_COST_LIMIT = 1099511627776.0;
+
+    template<typename CostT>
+    struct CostTraits;
+
+    template<int MaxDim, bool HasWeld, typename CostT>
+    struct FixedSolver;
+
+    template<int MaxDim>
+    static double dispatchFixed(const APriceList &priceList, int w, int h, double weld);
+
+    static bool isIntegral(double v) {
+        return v >= 0 && v < INT_COST_LIMIT && std::floor(v) == v;
+    }
+
+    // reach[i] bit set <=> i is a sum of catalogue side lengths (pieces may be rotated and repeated)
+    using Bitset = std::vector<uint64_t>;
+
+    static bool testBit(const Bitset &b, int i) { return (b[i >> 6] >> (i & 63)) & 1; }
+
+    static Bitset reachableLengths(const APriceList &priceList, int maxLen);
+
+    /**
+     * DP restricted to the widths/heights that can be assembled at all. Plates of other sizes can
+     * never be built, so only reachable coordinates get a table cell and only cuts whose both parts
+     * are reachable are tried. Coarse catalogues (e.g. sizes in multiples of 5) shrink the work by
+     * orders of magnitude.
+     */
+    struct SparseSolver {
+        SparseSolver(const APriceList &priceList, int w, int h, double ws,
+                     const Bitset &reachW, const Bitset &reachH);
+
+        double solve();
+
+        std::vector<int> xs, ys;        // reachable widths/heights, ascending
+        std::vector<int> xIdx, yIdx;    // length -> position in xs/ys, -1 if unreachable
+        double weld;
+        std::vector<double> dp;
+    };
+
     struct MemoSolver {
         MemoSolver(const std::map<std::pair<unsigned, unsigned>, double> & c,
                    int maxW, int maxH, double ws)
@@ -106,6 +226,170 @@ private:
     };
 };
 
+Mysolver::Bitset Mysolver::reachableLengths(const APriceList &priceList, int maxLen) {
+    Bitset reach((maxLen >> 6) + 1, 0);
+    reach[0] = 1;
+    std::vector<bool> seen(maxLen + 1, false);
+    for (auto &prod : priceList->m_List) {
+        for (unsigned d : {prod.m_W, prod.m_H}) {
+            if (d == 0 || (int)d > maxLen || seen[d])
+                continue;
+            seen[d] = true;
+            // unbounded subset sum: reach |= reach << d, then << 2d, << 4d, ...
+            for (size_t shift = d; shift <= (size_t)maxLen; shift <<= 1) {
+                size_t words = shift >> 6, bits = shift & 63;
+                for (size_t i = reach.size(); i-- > words;) {
+                    uint64_t v = reach[i - words] << bits;
+                    if (bits && i > words)
+                        v |= reach[i - words - 1] >> (64 - bits);
+                    reach[i] |= v;
+                }
+            }
+        }
+    }
+    return reach;
+}
+
+Mysolver::SparseSolver::SparseSolver(const APriceList &priceList, int w, int h, double ws,
+                                     const Bitset &reachW, const Bitset &reachH)
+        : xIdx(w + 1, -1), yIdx(h + 1, -1), weld(ws)
+{
+    for (int x = 1; x <= w; x++)
+        if (testBit(reachW, x)) {
+            xIdx[x] = (int)xs.size();
+            xs.push_back(x);
+        }
+    for (int y = 1; y <= h; y++)
+        if (testBit(reachH, y)) {
+            yIdx[y] = (int)ys.size();
+            ys.push_back(y);
+        }
+    dp.assign(xs.size() * ys.size(), DBL_MAX);
+
+    const size_t stride = ys.size();
+    for (auto &prod : priceList->m_List) {
+        for (int r = 0; r < 2; r++) {
+            int pw = r ? prod.m_H : prod.m_W;
+            int ph = r ? prod.m_W : prod.m_H;
+            if (pw == 0 || ph == 0 || pw > w || ph > h)
+                continue;
+            double &cell = dp[xIdx[pw] * stride + yIdx[ph]];
+            cell = std::min(cell, prod.m_Cost);
+        }
+    }
+}
+
+double Mysolver::SparseSolver::solve() {
+    const size_t stride = ys.size();
+    for (size_t i = 0; i < xs.size(); i++) {
+        int x = xs[i];
+        for (size_t j = 0; j < ys.size(); j++) {
+            int y = ys[j];
+            double best = dp[i * stride + j];
+            for (size_t k = 0; k < xs.size() && 2 * xs[k] <= x; k++) {
+                int rest = xIdx[x - xs[k]];
+                if (rest < 0)
+                    continue;
+                double c1 = dp[k * stride + j], c2 = dp[rest * stride + j];
+                if (c1 < DBL_MAX && c2 < DBL_MAX)
+                    best = std::min(best, c1 + c2 + weld * y);
+            }
+            for (size_t k = 0; k < ys.size() && 2 * ys[k] <= y; k++) {
+                int rest = yIdx[y - ys[k]];
+                if (rest < 0)
+                    continue;
+                double c1 = dp[i * stride + k], c2 = dp[i * stride + rest];
+                if (c1 < DBL_MAX && c2 < DBL_MAX)
+                    best = std::min(best, c1 + c2 + weld * x);
+            }
+            dp[i * stride + j] = best;
+        }
+    }
+    return dp.back();
+}
+
+template<>
+struct Mysolver::CostTraits<double> {
+    static constexpr double INF = DBL_MAX;
+    static double fromDouble(double v) { return v; }
+    static double toDouble(double v) { return v; }
+};
+
+template<>
+struct Mysolver::CostTraits<int64_t> {
+    // far below INT64_MAX so that INF + INF + weld term cannot overflow
+    static constexpr int64_t INF = INT64_C(1) << 60;
+    static int64_t fromDouble(double v) { return static_cast<int64_t>(v); }
+    static double toDouble(int64_t v) { return v >= INF ? DBL_MAX : static_cast<double>(v); }
+};
+
+/**
+ * Bottom-up variant of MemoSolver for plates up to MaxDim x MaxDim. The table lives on the stack
+ * with a compile-time stride, so the cut loops have fixed bounds the compiler can unroll/vectorize.
+ * An unreachable sub-plate holds INF; INF + anything never beats a real candidate, so the loops
+ * need no branches.
+ */
+template<int MaxDim, bool HasWeld, typename CostT>
+struct Mysolver::FixedSolver {
+    static constexpr int STRIDE = MaxDim + 1;
+    using Traits = CostTraits<CostT>;
+
+    static double solve(const APriceList &priceList, int w, int h, double weldStrength) {
+        CostT dp[STRIDE * STRIDE];
+        std::fill(dp, dp + STRIDE * STRIDE, Traits::INF);
+
+        for (auto &prod : priceList->m_List) {
+            CostT c = Traits::fromDouble(prod.m_Cost);
+            if ((int)prod.m_W <= w && (int)prod.m_H <= h && prod.m_W && prod.m_H) {
+                CostT &cell = dp[prod.m_W * STRIDE + prod.m_H];
+                cell = std::min(cell, c);
+            }
+            if ((int)prod.m_H <= w && (int)prod.m_W <= h && prod.m_W && prod.m_H) {
+                CostT &cell = dp[prod.m_H * STRIDE + prod.m_W];
+                cell = std::min(cell, c);
+            }
+        }
+
+        CostT weld = HasWeld ? Traits::fromDouble(weldStrength) : CostT(0);
+        for (int x = 1; x <= w; x++) {
+            for (int y = 1; y <= h; y++) {
+                CostT best = dp[x * STRIDE + y];
+                if constexpr (HasWeld) {
+                    CostT seamY = weld * y;
+                    for (int k = 1; k <= x / 2; k++)
+                        best = std::min(best, dp[k * STRIDE + y] + dp[(x - k) * STRIDE + y] + seamY);
+                    CostT seamX = weld * x;
+                    for (int k = 1; k <= y / 2; k++)
+                        best = std::min(best, dp[x * STRIDE + k] + dp[x * STRIDE + y - k] + seamX);
+                } else {
+                    for (int k = 1; k <= x / 2; k++)
+                        best = std::min(best, dp[k * STRIDE + y] + dp[(x - k) * STRIDE + y]);
+                    for (int k = 1; k <= y / 2; k++)
+                        best = std::min(best, dp[x * STRIDE + k] + dp[x * STRIDE + y - k]);
+                }
+                dp[x * STRIDE + y] = std::min(best, Traits::INF);
+            }
+        }
+        return Traits::toDouble(dp[w * STRIDE + h]);
+    }
+};
+
+template<int MaxDim>
+double Mysolver::dispatchFixed(const APriceList &priceList, int w, int h, double weld) {
+    bool integral = isIntegral(weld) && weld * (2 * MaxDim) < INT_COST_LIMIT;
+    for (auto it = priceList->m_List.begin(); integral && it != priceList->m_List.end(); ++it)
+        integral = isIntegral(it->m_Cost);
+
+    if (weld == 0) {
+        if (integral)
+            return FixedSolver<MaxDim, false, int64_t>::solve(priceList, w, h, weld);
+        return FixedSolver<MaxDim, false, double>::solve(priceList, w, h, weld);
+    }
+    if (integral)
+        return FixedSolver<MaxDim, true, int64_t>::solve(priceList, w, h, weld);
+    return FixedSolver<MaxDim, true, double>::solve(priceList, w, h, weld);
+}
+
 double Mysolver::calculatePrice(const APriceList &priceList,
                                 int w, int h,
                                 double weldStrength,
@@ -114,6 +398,24 @@ double Mysolver::calculatePrice(const APriceList &priceList,
     if (!priceList || w <= 0 || h <= 0)
         return DBL_MAX;
 
+    if (w <= SMALL_DIM && h <= SMALL_DIM)
+        return dispatchFixed<SMALL_DIM>(priceList, w, h, weldStrength);
+    if (w <= MEDIUM_DIM && h <= MEDIUM_DIM)
+        return dispatchFixed<MEDIUM_DIM>(priceList, w, h, weldStrength);
+
+    Bitset reach = reachableLengths(priceList, std::max(w, h));
+    if (!testBit(reach, w) || !testBit(reach, h))
+        return DBL_MAX;
+    SparseSolver sparse(priceList, w, h, weldStrength, reach, reach);
+    if (sparse.xs.size() * sparse.ys.size() * 2 <= (size_t)w * h)
+        return sparse.solve();
+    return memoPrice(priceList, w, h, weldStrength);
+}
+
+double Mysolver::memoPrice(const APriceList &priceList, int w, int h, double weldStrength) {
+    if (!priceList || w <= 0 || h <= 0)
+        return DBL_MAX;
+
     std::map<std::pair<unsigned, unsigned>, double> currentCost;
     for (auto &prod : priceList->m_List) {
         unsigned w1 = prod.m_W;
@@ -156,7 +458,28 @@ public:
     void senderThreadMethod();
     void start(unsigned thrCount);
     void stop();
+    bool saveSnapshot(const char *path, bool withCostTables = false);
+    bool loadSnapshot(const char *path);
+    void enableCostTables(bool enable = true) { costTablesEnabled = enable; }
+    // capacity 0 = unbounded; call before start(). orderCap bounds the accepted order lists not yet
+    // taken by a worker (ready + waiting for price lists), waitingCap the waiting ones alone
+    void setQueueLimits(size_t orderCap, size_t waitingCap, size_t completedCap);
+    void setAdmissionPolicy(AdmissionPolicy policy, double budget);
+    ThrottleStats throttleStats() const;
+    // rough number of cut candidates the DP evaluates for the whole list
+    static double estimateSolveCost(const AOrderList &list);
 private:
+    void reserveSlot();
+    void releaseSlot();
+    void enqueueReady(const orderItem &item);
+    void pushCompleted(const orderItem &item, bool mayWait = true);
+    void releaseQueued();
+    void notifyCapacity();
+    void promoteRefreshed(int matID);
+    bool lookupCost(int matID, uint64_t version, const COrder &ord, double &cost);
+    void storeCost(int matID, uint64_t version, const COrder &ord, double cost);
+    bool parseSnapshot(const char *data, size_t len);
+
     std::vector<AProducer> prodList;
     std::vector<ACustomer> custList;
     std::queue<orderItem> orderQueue;
@@ -179,6 +502,28 @@ private:
     std::atomic_bool runningWorkerThread{false};
     std::unordered_map<int, std::vector<orderItem>> waitingOrderQueue;
     std::mutex waitingQueueMutex;
+    std::unordered_map<int, uint64_t> priceListVersion;
+    std::unordered_set<int> warmMaterials;
+    std::unordered_map<int, APriceList> refreshLists;
+    std::unordered_map<int, CostTable> costTables;
+    std::mutex costTableMutex;
+    std::atomic_bool costTablesEnabled{false};
+    std::queue<orderItem> deferredQueue;
+    size_t orderQueueCap = 0;
+    size_t waitingQueueCap = 0;
+    size_t completedQueueCap = 0;
+    AdmissionPolicy admissionPolicy = AdmissionPolicy::ADMIT;
+    double admissionBudget = 0;
+    std::atomic<size_t> queuedOrders{0};
+    std::atomic<size_t> waitingOrders{0};
+    size_t reservedSlots = 0;   // demands being pulled by receivers, not queued yet; guarded by capacityMutex
+    std::mutex capacityMutex;
+    std::condition_variable capacityCV;
+    std::condition_variable completedSpaceCV;
+    std::atomic<size_t> receiverWaits{0};
+    std::atomic<size_t> completedWaits{0};
+    std::atomic<size_t> rejectedOrders{0};
+    std::atomic<size_t> deferredOrders{0};
 };
 
 void CWeldingCompany::addProducer(AProducer prod) {
@@ -204,7 +549,9 @@ void CWeldingCompany::addPriceList(AProducer prod, APriceList newList) {
 
     {
         std::lock_guard<std::mutex> lock(priceListMutex);
-        auto &existing = priceLists[newList->m_MaterialID];
+        int mid = newList->m_MaterialID;
+        bool warm = warmMaterials.count(mid) > 0;
+        auto &existing = warm ? refreshLists[mid] : priceLists[mid];
         if (!existing)
             existing = std::make_shared<CPriceList>(newList->m_MaterialID);
 
@@ -236,6 +583,8 @@ void CWeldingCompany::addPriceList(AProducer prod, APriceList newList) {
             newListVec.push_back(CProd(W, H, cost));
         }
         existing->m_List = std::move(newListVec);
+        if (!warm)
+            priceListVersion[mid]++;
     }
     {
         std::lock_guard<std::mutex> lock(priceListMutex);
@@ -249,14 +598,17 @@ void CWeldingCompany::addPriceList(AProducer prod, APriceList newList) {
                 tmp.prodRemain--;
             if (tmp.prodRemain == 0) {
                 tmp.isAnswered = true;
+                promoteRefreshed(mid);
                 priceListCV.notify_all();
                 {
                     std::lock_guard<std::mutex> plock(waitingQueueMutex);
                     if (waitingOrderQueue.count(mid) > 0) {
                         std::lock_guard<std::mutex> qlock(queueMutex);
                         for (auto &ord : waitingOrderQueue[mid])
-                            orderQueue.push(ord);
+                            enqueueReady(ord);
+                        waitingOrders -= waitingOrderQueue[mid].size();
                         waitingOrderQueue.erase(mid);
+                        notifyCapacity();
                         queueCV.notify_all();
                     }
                 }
@@ -270,14 +622,17 @@ void CWeldingCompany::addPriceList(AProducer prod, APriceList newList) {
                     info.prodRemain--;
                 if (info.prodRemain == 0) {
                     info.isAnswered = true;
+                    promoteRefreshed(mid);
                     priceListCV.notify_all();
                     {
                         std::lock_guard<std::mutex> plock(waitingQueueMutex);
                         if (waitingOrderQueue.count(mid) > 0) {
                             std::lock_guard<std::mutex> qlock(queueMutex);
                             for (auto &ord : waitingOrderQueue[mid])
-                                orderQueue.push(ord);
+                                enqueueReady(ord);
+                            waitingOrders -= waitingOrderQueue[mid].size();
                             waitingOrderQueue.erase(mid);
+                            notifyCapacity();
                             queueCV.notify_all();
                         }
                     }
@@ -303,10 +658,21 @@ void CWeldingCompany::start(unsigned int thrCount) {
 
 void CWeldingCompany::receiverThreadMethod(ACustomer customer) {
     while (true) {
+        reserveSlot();
         AOrderList tmpOrder = customer->waitForDemand();
-        if (!tmpOrder)
+        if (!tmpOrder) {
+            releaseSlot();
             break;
+        }
         orderItem orderGroup = {tmpOrder, customer};
+        if (admissionPolicy == AdmissionPolicy::REJECT && estimateSolveCost(tmpOrder) > admissionBudget) {
+            for (auto &ord : tmpOrder->m_List)
+                ord.m_Cost = DBL_MAX;
+            rejectedOrders++;
+            releaseSlot();
+            pushCompleted(orderGroup, false);
+            continue;
+        }
         int matID = (int)tmpOrder->m_MaterialID;
         {
             std::lock_guard<std::mutex> lock(requestedIDMutex);
@@ -320,17 +686,19 @@ void CWeldingCompany::receiverThreadMethod(ACustomer customer) {
         {
             std::lock_guard<std::mutex> lock(priceListMutex);
             auto it = requestId.find(matID);
-            if (it != requestId.end() && it->second.prodRemain == 0)
+            if ((it != requestId.end() && it->second.prodRemain == 0) || warmMaterials.count(matID))
                 ready = true;
         }
         if (ready) {
             std::lock_guard<std::mutex> lock(queueMutex);
-            orderQueue.push(orderGroup);
+            enqueueReady(orderGroup);
             queueCV.notify_one();
         } else {
             std::lock_guard<std::mutex> lock(waitingQueueMutex);
             waitingOrderQueue[matID].push_back(orderGroup);
+            waitingOrders++;
         } // todo pryam stranno
+        releaseSlot();
     }
 }
 
@@ -340,43 +708,54 @@ void CWeldingCompany::workingThreadMethod() {
         {
             std::unique_lock<std::mutex> lkQ(queueMutex);
             queueCV.wait(lkQ, [this]() {
-                return !orderQueue.empty() || (stopQueue.load() && allProducersDone);
+                return !orderQueue.empty() || !deferredQueue.empty() || (stopQueue.load() && allProducersDone);
             });
-            if (stopQueue.load() && orderQueue.empty() && allProducersDone.load())
+            if (stopQueue.load() && orderQueue.empty() && deferredQueue.empty() && allProducersDone.load())
                 return;
-            if (orderQueue.empty())
+            if (!orderQueue.empty()) {
+                order = orderQueue.front();
+                orderQueue.pop();
+            } else if (!deferredQueue.empty()) {
+                order = deferredQueue.front();
+                deferredQueue.pop();
+            } else
                 continue;
-
-            order = orderQueue.front();
-            orderQueue.pop();
         }
+        releaseQueued();
 
         int matID = (int)order.first->m_MaterialID;
         APriceList tmpPriceList;
+        uint64_t version = 0;
         {
             std::lock_guard<std::mutex> gl(priceListMutex);
             auto itPL = priceLists.find(matID);
-            if (itPL != priceLists.end())
+            if (itPL != priceLists.end()) {
                 tmpPriceList = itPL->second;
+                version = priceListVersion[matID];
+            }
         }
 
         if (!tmpPriceList) {
             for (auto &ord : order.first->m_List)
                 ord.m_Cost = DBL_MAX;
         } else {
+            bool useTables = costTablesEnabled.load();
             for (auto &ord : order.first->m_List){
-                double c = Mysolver::calculatePrice(tmpPriceList,
-                                                    ord.m_W,
-                                                    ord.m_H,
-                                                    ord.m_WeldingStrength);
+                double c;
+                if (useTables && lookupCost(matID, version, ord, c)) {
+                    ord.m_Cost = c;
+                    continue;
+                }
+                c = Mysolver::calculatePrice(tmpPriceList,
+                                             ord.m_W,
+                                             ord.m_H,
+                                             ord.m_WeldingStrength);
                 ord.m_Cost = (c < DBL_MAX) ? c : DBL_MAX;
+                if (useTables)
+                    storeCost(matID, version, ord, ord.m_Cost);
             }
         } // \todo strannaya xuina
-        {
-            std::lock_guard<std::mutex> lkC(completedOrdersMutex);
-            completedOrders.push(order);
-        }
-        completedOrdersCV.notify_one();
+        pushCompleted(order);
     }
 }
 
@@ -393,6 +772,7 @@ void CWeldingCompany::senderThreadMethod() {
             if (!completedOrders.empty()) {
                 orderList = completedOrders.front();
                 completedOrders.pop();
+                completedSpaceCV.notify_one();
             } else
                 continue;
         }
@@ -440,10 +820,654 @@ void CWeldingCompany::stop() {
         senderThread.join();
 }
 
+void CWeldingCompany::setQueueLimits(size_t orderCap, size_t waitingCap, size_t completedCap) {
+    orderQueueCap = orderCap;
+    waitingQueueCap = waitingCap;
+    completedQueueCap = completedCap;
+}
+
+void CWeldingCompany::setAdmissionPolicy(AdmissionPolicy policy, double budget) {
+    admissionPolicy = policy;
+    admissionBudget = budget;
+}
+
+ThrottleStats CWeldingCompany::throttleStats() const {
+    return {receiverWaits.load(), completedWaits.load(), rejectedOrders.load(), deferredOrders.load()};
+}
+
+double CWeldingCompany::estimateSolveCost(const AOrderList &list) {
+    double total = 0;
+    for (auto &ord : list->m_List)
+        total += (double)ord.m_W * ord.m_H * ((double)ord.m_W + ord.m_H);
+    return total;
+}
+
+/* Backpressure: a receiver reserves room for one order list before waitForDemand pulls it, under the
+ * same lock that checks the limits, so concurrent receivers cannot overshoot them. The queued/waiting
+ * counters grow before the reservation is released, they never under-count.
+ */
+void CWeldingCompany::reserveSlot() {
+    auto hasSpace = [this]() {
+        size_t taken = reservedSlots + 1;
+        return (!orderQueueCap || queuedOrders.load() + waitingOrders.load() + taken <= orderQueueCap)
+               && (!waitingQueueCap || waitingOrders.load() + taken <= waitingQueueCap);
+    };
+    std::unique_lock<std::mutex> lock(capacityMutex);
+    if (!hasSpace()) {
+        receiverWaits++;
+        capacityCV.wait(lock, hasSpace);
+    }
+    reservedSlots++;
+}
+
+void CWeldingCompany::releaseSlot() {
+    {
+        std::lock_guard<std::mutex> lock(capacityMutex);
+        reservedSlots--;
+    }
+    capacityCV.notify_all();
+}
+
+// caller holds queueMutex
+void CWeldingCompany::enqueueReady(const orderItem &item) {
+    queuedOrders++;
+    if (admissionPolicy == AdmissionPolicy::DEFER && estimateSolveCost(item.first) > admissionBudget) {
+        deferredOrders++;
+        deferredQueue.push(item);
+    } else
+        orderQueue.push(item);
+}
+
+void CWeldingCompany::releaseQueued() {
+    queuedOrders--;
+    notifyCapacity();
+}
+
+void CWeldingCompany::notifyCapacity() {
+    { std::lock_guard<std::mutex> lock(capacityMutex); }
+    capacityCV.notify_all();
+}
+
+// mayWait = false (rejected lists) may exceed completedQueueCap instead of blocking the receiver
+void CWeldingCompany::pushCompleted(const orderItem &item, bool mayWait) {
+    {
+        std::unique_lock<std::mutex> lkC(completedOrdersMutex);
+        if (mayWait && completedQueueCap && completedOrders.size() >= completedQueueCap) {
+            completedWaits++;
+            completedSpaceCV.wait(lkC, [this]() { return completedOrders.size() < completedQueueCap; });
+        }
+        completedOrders.push(item);
+    }
+    completedOrdersCV.notify_one();
+}
+
+// caller holds priceListMutex; swaps a snapshot catalogue for the fully refreshed one
+void CWeldingCompany::promoteRefreshed(int matID) {
+    if (!warmMaterials.erase(matID))
+        return;
+    auto it = refreshLists.find(matID);
+    if (it != refreshLists.end()) {
+        priceLists[matID] = it->second;
+        refreshLists.erase(it);
+    }
+    priceListVersion[matID]++;
+}
+
+bool CWeldingCompany::lookupCost(int matID, uint64_t version, const COrder &ord, double &cost) {
+    std::lock_guard<std::mutex> lock(costTableMutex);
+    auto it = costTables.find(matID);
+    if (it == costTables.end() || it->second.version != version)
+        return false;
+    auto itC = it->second.entries.find({ord.m_W, ord.m_H, ord.m_WeldingStrength});
+    if (itC == it->second.entries.end())
+        return false;
+    cost = itC->second;
+    return true;
+}
+
+void CWeldingCompany::storeCost(int matID, uint64_t version, const COrder &ord, double cost) {
+    std::lock_guard<std::mutex> lock(costTableMutex);
+    CostTable &table = costTables[matID];
+    if (table.version != version) {
+        table.entries.clear();
+        table.version = version;
+    }
+    table.entries[{ord.m_W, ord.m_H, ord.m_WeldingStrength}] = cost;
+}
+
+bool CWeldingCompany::saveSnapshot(const char *path, bool withCostTables) {
+    std::vector<char> out(sizeof(SnapshotHeader));
+    auto append = [&out](const void *src, size_t len) {
+        out.insert(out.end(), (const char *)src, (const char *)src + len);
+    };
+
+    SnapshotHeader hdr{};
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    std::unordered_map<int, uint64_t> versions;
+    {
+        std::lock_guard<std::mutex> lock(priceListMutex);
+        for (auto &entry : priceLists) {
+            if (!entry.second)
+                continue;
+            uint64_t version = priceListVersion[entry.first];
+            SnapshotMaterial mat{(uint32_t)entry.first, (uint32_t)entry.second->m_List.size(), version};
+            append(&mat, sizeof(mat));
+            for (auto &prod : entry.second->m_List) {
+                SnapshotProd sp{prod.m_W, prod.m_H, prod.m_Cost};
+                append(&sp, sizeof(sp));
+            }
+            versions[entry.first] = version;
+            hdr.materialCount++;
+        }
+    }
+    if (withCostTables) {
+        std::lock_guard<std::mutex> lock(costTableMutex);
+        for (auto &entry : costTables) {
+            auto itV = versions.find(entry.first);
+            if (itV == versions.end() || itV->second != entry.second.version)
+                continue;
+            SnapshotTable tab{(uint32_t)entry.first, (uint32_t)entry.second.entries.size(), entry.second.version};
+            append(&tab, sizeof(tab));
+            for (auto &cost : entry.second.entries) {
+                SnapshotCost sc{cost.first.w, cost.first.h, cost.first.weld, cost.second};
+                append(&sc, sizeof(sc));
+            }
+            hdr.tableCount++;
+        }
+    }
+    memcpy(out.data(), &hdr, sizeof(hdr));
+
+    std::string tmpPath = std::string(path) + ".tmp";
+    FILE *fp = fopen(tmpPath.c_str(), "wb");
+    if (!fp)
+        return false;
+    bool ok = fwrite(out.data(), 1, out.size(), fp) == out.size();
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmpPath.c_str(), path) != 0) {
+        remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+// the whole file is parsed into the regular containers, so it is read once instead of kept mapped
+bool CWeldingCompany::loadSnapshot(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+    std::vector<char> data;
+    char buf[4096];
+    size_t got;
+    while ((got = fread(buf, 1, sizeof(buf), fp)) > 0)
+        data.insert(data.end(), buf, buf + got);
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok && parseSnapshot(data.data(), data.size());
+}
+
+// materials already present (fresh lists) win over the snapshot; the rest become warm entries
+bool CWeldingCompany::parseSnapshot(const char *data, size_t len) {
+    if (len < sizeof(SnapshotHeader))
+        return false;
+    SnapshotHeader hdr;
+    memcpy(&hdr, data, sizeof(hdr));
+    if (memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0)
+        return false;
+
+    size_t pos = sizeof(hdr);
+    std::vector<std::pair<SnapshotMaterial, APriceList>> materials;
+    for (uint32_t i = 0; i < hdr.materialCount; i++) {
+        SnapshotMaterial mat;
+        if (len - pos < sizeof(mat))
+            return false;
+        memcpy(&mat, data + pos, sizeof(mat));
+        pos += sizeof(mat);
+        if ((len - pos) / sizeof(SnapshotProd) < mat.prodCount)
+            return false;
+        APriceList list = std::make_shared<CPriceList>(mat.materialID);
+        list->m_List.reserve(mat.prodCount);
+        for (uint32_t k = 0; k < mat.prodCount; k++, pos += sizeof(SnapshotProd)) {
+            SnapshotProd sp;
+            memcpy(&sp, data + pos, sizeof(sp));
+            list->m_List.emplace_back(sp.w, sp.h, sp.cost);
+        }
+        materials.emplace_back(mat, list);
+    }
+
+    std::vector<std::pair<int, CostTable>> tables;
+    for (uint32_t i = 0; i < hdr.tableCount; i++) {
+        SnapshotTable tab;
+        if (len - pos < sizeof(tab))
+            return false;
+        memcpy(&tab, data + pos, sizeof(tab));
+        pos += sizeof(tab);
+        if ((len - pos) / sizeof(SnapshotCost) < tab.entryCount)
+            return false;
+        CostTable table;
+        table.version = tab.version;
+        table.entries.reserve(tab.entryCount);
+        for (uint32_t k = 0; k < tab.entryCount; k++, pos += sizeof(SnapshotCost)) {
+            SnapshotCost sc;
+            memcpy(&sc, data + pos, sizeof(sc));
+            table.entries[{sc.w, sc.h, sc.weld}] = sc.cost;
+        }
+        tables.emplace_back((int)tab.materialID, std::move(table));
+    }
+
+    std::unordered_set<int> loaded;
+    {
+        std::lock_guard<std::mutex> lock(priceListMutex);
+        for (auto &mat : materials) {
+            int mid = (int)mat.first.materialID;
+            if (mid == 0 || priceLists.count(mid))
+                continue;
+            priceLists[mid] = mat.second;
+            priceListVersion[mid] = mat.first.version;
+            warmMaterials.insert(mid);
+            loaded.insert(mid);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(costTableMutex);
+        for (auto &tab : tables)
+            if (loaded.count(tab.first))
+                costTables[tab.first] = std::move(tab.second);
+    }
+    return true;
+}
+
 //-------------------------------------------------------------------------------------------------
 #ifndef __PROGTEST__
 
-int main() {
+static bool samePrice(double a, double b) {
+    if (a >= DBL_MAX || b >= DBL_MAX)
+        return a >= DBL_MAX && b >= DBL_MAX;
+    return fabs(a - b) <= 1e-9 * std::max(1.0, fabs(b));
+}
+
+/* Randomized differential check of Mysolver::calculatePrice against the generic memoPrice.
+ * Plate sizes straddle the 16/32 dispatch boundaries, prices and weld strengths straddle the
+ * integral cutoff of the int64 kernels (2^40 for prices, 2^40 / (2 * MaxDim) for the weld term).
+ */
+static bool testSolverPaths(size_t rounds) {
+    static const int EDGE_DIMS[] = {1, 2, 15, 16, 17, 31, 32, 33};
+    static const double CUTOFF_PRICES[] = {1099511627775.0, 1099511627776.0, 1099511627777.0};
+    static const double CUTOFF_WELDS[] = {17179869183.0, 17179869184.0, 34359738367.0, 34359738368.0};
+    std::mt19937 rng(26);
+    auto pick = [&rng](int lo, int hi) { return std::uniform_int_distribution<int>(lo, hi)(rng); };
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < rounds; i++) {
+        int w = pick(0, 1) ? EDGE_DIMS[pick(0, 7)] : pick(1, 40);
+        int h = pick(0, 1) ? EDGE_DIMS[pick(0, 7)] : pick(1, 40);
+        int priceMode = pick(0, 2);         // small integral, around the integral cutoff, fractional
+        APriceList list = std::make_shared<CPriceList>(1);
+        for (int k = pick(1, 6); k > 0; k--) {
+            double cost = pick(1, 500);
+            if (priceMode == 1 && pick(0, 1))
+                cost = CUTOFF_PRICES[pick(0, 2)];
+            else if (priceMode == 2)
+                cost += pick(0, 999) / 1000.0;
+            list->add(CProd(pick(1, 12), pick(1, 12), cost));
+        }
+        double weld;
+        switch (pick(0, 3)) {
+            case 0:  weld = 0; break;
+            case 1:  weld = pick(1, 20); break;
+            case 2:  weld = pick(0, 2000) / 100.0; break;
+            default: weld = CUTOFF_WELDS[pick(0, 3)]; break;
+        }
+
+        double got = Mysolver::calculatePrice(list, w, h, weld);
+        double want = Mysolver::memoPrice(list, w, h, weld);
+        if (!samePrice(got, want)) {
+            if (mismatches++ < 5)
+                printf("  %dx%d weld %.3f: %.6f, expected %.6f\n", w, h, weld, got, want);
+        }
+    }
+    printf("testSolverPaths, status = %s\n", mismatches ? "fail" : "OK");
+    return !mismatches;
+}
+
+/* Differential check of the plates above 32x32: coarse catalogues (side lengths sharing a step)
+ * leave few reachable widths/heights and select SparseSolver, mixed ones stay with memoPrice.
+ * Every catalogue is classified the way calculatePrice does it, both sides of the
+ * xs * ys * 2 <= w * h threshold have to be hit, including cases close to it.
+ */
+static bool testSparsePaths(size_t rounds) {
+    std::mt19937 rng(30);
+    auto pick = [&rng](int lo, int hi) { return std::uniform_int_distribution<int>(lo, hi)(rng); };
+
+    size_t mismatches = 0, sparse = 0, dense = 0, nearThreshold = 0;
+    for (size_t i = 0; i < rounds; i++) {
+        int w = pick(33, 72), h = pick(33, 72);
+        int step = pick(1, 5);
+        APriceList list = std::make_shared<CPriceList>(1);
+        for (int k = pick(1, 5); k > 0; k--)
+            list->add(CProd(step * pick(1, 8), step * pick(1, 8), pick(1, 900) + pick(0, 3) / 4.0));
+        if (pick(0, 3) == 0)        // one odd piece makes most lengths reachable again
+            list->add(CProd(pick(1, 9), pick(1, 9), pick(1, 900)));
+        double weld = pick(0, 1) ? pick(0, 30) : pick(0, 300) / 10.0;
+
+        std::vector<bool> reach(std::max(w, h) + 1, false);
+        reach[0] = true;
+        for (size_t len = 1; len < reach.size(); len++)
+            for (auto &prod : list->m_List)
+                for (unsigned d : {prod.m_W, prod.m_H})
+                    if (d <= len && reach[len - d])
+                        reach[len] = true;
+        if (reach[w] && reach[h]) {
+            size_t xs = std::count(reach.begin() + 1, reach.begin() + w + 1, true);
+            size_t ys = std::count(reach.begin() + 1, reach.begin() + h + 1, true);
+            (xs * ys * 2 <= (size_t)w * h ? sparse : dense)++;
+            if (fabs((double)(xs * ys * 2) / ((double)w * h) - 1) < 0.1)
+                nearThreshold++;
+        }
+
+        double got = Mysolver::calculatePrice(list, w, h, weld);
+        double want = Mysolver::memoPrice(list, w, h, weld);
+        if (!samePrice(got, want)) {
+            if (mismatches++ < 5)
+                printf("  %dx%d weld %.3f: %.6f, expected %.6f\n", w, h, weld, got, want);
+        }
+    }
+    bool ok = !mismatches && sparse && dense && nearThreshold;
+    printf("testSparsePaths (%zu sparse, %zu dense, %zu near the threshold), status = %s\n", sparse, dense,
+           nearThreshold, ok ? "OK" : "fail");
+    return ok;
+}
+
+static bool readFile(const char *path, std::string &data) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+    char buf[4096];
+    size_t got;
+    data.clear();
+    while ((got = fread(buf, 1, sizeof(buf), fp)) > 0)
+        data.append(buf, got);
+    fclose(fp);
+    return true;
+}
+
+static bool writeFile(const char *path, const std::string &data) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+    return (fclose(fp) == 0) && ok;
+}
+
+// snapshot records in a canonical order: hash map iteration decides the order materials and cost entries are saved in
+static std::vector<std::string> snapshotRecords(const std::string &data) {
+    std::vector<std::string> records;
+    SnapshotHeader hdr;
+    memcpy(&hdr, data.data(), sizeof(hdr));
+    size_t pos = sizeof(hdr);
+    for (uint32_t i = 0; i < hdr.materialCount; i++) {
+        SnapshotMaterial mat;
+        memcpy(&mat, data.data() + pos, sizeof(mat));
+        size_t len = sizeof(mat) + mat.prodCount * sizeof(SnapshotProd);
+        records.push_back("M" + data.substr(pos, len));
+        pos += len;
+    }
+    for (uint32_t i = 0; i < hdr.tableCount; i++) {
+        SnapshotTable tab;
+        memcpy(&tab, data.data() + pos, sizeof(tab));
+        std::string rec = "T" + data.substr(pos, sizeof(tab));
+        pos += sizeof(tab);
+        std::vector<std::string> entries;
+        for (uint32_t k = 0; k < tab.entryCount; k++, pos += sizeof(SnapshotCost))
+            entries.push_back(data.substr(pos, sizeof(SnapshotCost)));
+        std::sort(entries.begin(), entries.end());
+        for (auto &e : entries)
+            rec += e;
+        records.push_back(rec);
+    }
+    std::sort(records.begin(), records.end());
+    return records;
+}
+
+/* Snapshot round trip: the sample scenario fills catalogues and cost tables, a fresh company loads
+ * them and has to save the same records again. Truncated, mislabelled and oversized files are
+ * rejected without installing anything.
+ */
+static bool testSnapshot() {
+    using namespace std::placeholders;
+    const char *path = "snapshot_test.bin", *copyPath = "snapshot_test_copy.bin", *badPath = "snapshot_test_bad.bin";
+    bool ok = true;
+    {
+        CWeldingCompany test;
+        test.enableCostTables();
+        AProducer p1 = std::make_shared<CProducerSync>(std::bind(&CWeldingCompany::addPriceList, &test, _1, _2));
+        AProducerAsync p2 = std::make_shared<CProducerAsync>(std::bind(&CWeldingCompany::addPriceList, &test, _1, _2));
+        test.addProducer(p1);
+        test.addProducer(p2);
+        test.addCustomer(std::make_shared<CCustomerTest>(2));
+        p2->start();
+        test.start(2);
+        test.stop();
+        p2->stop();
+        ok = test.saveSnapshot(path, true);
+    }
+
+    std::string saved, copy;
+    {
+        CWeldingCompany restored;
+        ok = ok && restored.loadSnapshot(path) && restored.saveSnapshot(copyPath, true);
+    }
+    ok = ok && readFile(path, saved) && readFile(copyPath, copy) && saved.size() == copy.size()
+         && snapshotRecords(saved) == snapshotRecords(copy);
+    SnapshotHeader hdr;
+    memcpy(&hdr, saved.data(), sizeof(hdr));
+    ok = ok && hdr.materialCount == 1 && hdr.tableCount == 1;
+
+    std::string oversized = saved;
+    hdr.materialCount = 1000000;
+    memcpy(oversized.data(), &hdr, sizeof(hdr));
+    std::string mislabelled = saved;
+    mislabelled[0] = 'X';
+    for (const std::string &bad : {saved.substr(0, saved.size() - 5), saved.substr(0, sizeof(SnapshotHeader) - 1),
+                                   oversized, mislabelled}) {
+        CWeldingCompany restored;
+        ok = ok && writeFile(badPath, bad) && !restored.loadSnapshot(badPath) && restored.saveSnapshot(copyPath, true)
+             && readFile(copyPath, copy) && copy.size() == sizeof(SnapshotHeader);
+    }
+    CWeldingCompany missing;
+    ok = ok && !missing.loadSnapshot("snapshot_test_missing.bin");
+
+    remove(path);
+    remove(copyPath);
+    remove(badPath);
+    printf("testSnapshot, status = %s\n", ok ? "OK" : "fail");
+    return ok;
+}
+
+/* Trace files: a saved trace loads back event by event; truncated, mislabelled files and counts larger
+ * than the file can hold are rejected before anything is allocated, leaving the loaded trace untouched.
+ */
+static bool testTraceLoad() {
+    const char *path = "trace_test.bin", *badPath = "trace_test_bad.bin";
+    CTrace trace;
+    trace.m_Producers = 2;
+    trace.m_Customers = 1;
+    for (uint32_t i = 0; i < 3; i++) {
+        CTraceEvent ev{};
+        ev.m_Rec.m_Type = TRACE_ADD_PRICE_LIST;
+        ev.m_Rec.m_MaterialID = i;
+        ev.m_Items.assign(i + 1, CTraceItem{i, i + 1, 2.5 * i, 0});
+        ev.m_Rec.m_ItemCount = (uint32_t)ev.m_Items.size();
+        trace.m_Events.push_back(ev);
+    }
+    bool ok = trace.save(path);
+
+    CTrace loaded;
+    ok = ok && loaded.load(path) && loaded.m_Producers == 2 && loaded.m_Customers == 1
+         && loaded.m_Events.size() == trace.m_Events.size();
+    for (size_t i = 0; ok && i < loaded.m_Events.size(); i++) {
+        const CTraceEvent &a = trace.m_Events[i], &b = loaded.m_Events[i];
+        ok = memcmp(&a.m_Rec, &b.m_Rec, sizeof(a.m_Rec)) == 0 && a.m_Items.size() == b.m_Items.size()
+             && memcmp(a.m_Items.data(), b.m_Items.data(), a.m_Items.size() * sizeof(CTraceItem)) == 0;
+    }
+
+    std::string saved;
+    ok = ok && readFile(path, saved);
+    const size_t headerSize = saved.size() - 3 * sizeof(CTraceRecord) - 6 * sizeof(CTraceItem);
+    std::string manyEvents = saved, manyItems = saved, mislabelled = saved;
+    uint64_t eventCount = UINT64_MAX / 2;
+    memcpy(manyEvents.data() + headerSize - sizeof(eventCount), &eventCount, sizeof(eventCount));
+    uint32_t itemCount = UINT32_MAX;
+    memcpy(manyItems.data() + headerSize + offsetof(CTraceRecord, m_ItemCount), &itemCount, sizeof(itemCount));
+    mislabelled[0] = 'X';
+    for (const std::string &bad : {saved.substr(0, saved.size() - 5), saved.substr(0, headerSize - 1),
+                                   manyEvents, manyItems, mislabelled}) {
+        ok = ok && writeFile(badPath, bad) && !loaded.load(badPath) && loaded.m_Events.size() == 3;
+    }
+    ok = ok && !loaded.load("trace_test_missing.bin");
+
+    remove(path);
+    remove(badPath);
+    printf("testTraceLoad, status = %s\n", ok ? "OK" : "fail");
+    return ok;
+}
+
+// shared by all customers of a throttling test: order lists accepted but not yet completed
+struct CThrottleProbe {
+    std::atomic<int> outstanding{0};
+    std::atomic<int> maxOutstanding{0};
+    std::atomic<int> wrongCosts{0};
+    std::atomic<int> completedLists{0};
+};
+
+// every third demand is a 30x30 plate far over any admission budget used below, the rest are 2x2 plates (cost 40)
+class CThrottleCustomer : public CCustomer {
+public:
+    CThrottleCustomer(CThrottleProbe &probe, unsigned count, bool rejectBig)
+            : m_Probe(probe), m_Count(count), m_RejectBig(rejectBig) {
+    }
+
+    virtual AOrderList waitForDemand() override {
+        if (!m_Count)
+            return AOrderList();
+        // a slow demand source keeps receivers between the capacity check and the enqueue for a while
+        std::this_thread::sleep_for(std::chrono::microseconds(300));
+        AOrderList req = std::make_shared<COrderList>(1);
+        if (m_Count-- % 3 == 0)
+            req->add(COrder(30, 30, 1.0));
+        else
+            req->add(COrder(2, 2, 0.0));
+        int now = ++m_Probe.outstanding;
+        for (int seen = m_Probe.maxOutstanding; now > seen && !m_Probe.maxOutstanding.compare_exchange_weak(seen, now);) {
+        }
+        return req;
+    }
+
+    virtual void completed(AOrderList x) override {
+        const COrder &ord = x->m_List[0];
+        bool big = ord.m_W == 30;
+        if (big ? (m_RejectBig ? ord.m_Cost != DBL_MAX : ord.m_Cost >= DBL_MAX) : fabs(ord.m_Cost - 40) > 1e-9)
+            m_Probe.wrongCosts++;
+        m_Probe.outstanding--;
+        m_Probe.completedLists++;
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+
+private:
+    CThrottleProbe &m_Probe;
+    unsigned m_Count;
+    bool m_RejectBig;
+};
+
+/* Queue limits and admission control with many receivers and a slow customer. Accepted but uncompleted
+ * lists never exceed orderCap + workers + completedCap + the one the sender delivers; rejected lists
+ * bypass every limit. Each policy's counters in throttleStats() have to match the traffic.
+ */
+static bool testThrottling() {
+    using namespace std::placeholders;
+    static const unsigned CUSTOMERS = 8, DEMANDS = 30, WORKERS = 2;
+    static const size_t ORDER_CAP = 3, WAITING_CAP = 2, COMPLETED_CAP = 1;
+    static const size_t BIG = CUSTOMERS * (DEMANDS / 3);
+    bool ok = true;
+    for (AdmissionPolicy policy : {AdmissionPolicy::ADMIT, AdmissionPolicy::REJECT, AdmissionPolicy::DEFER}) {
+        CThrottleProbe probe;
+        CWeldingCompany test;
+        test.setQueueLimits(ORDER_CAP, WAITING_CAP, COMPLETED_CAP);
+        test.setAdmissionPolicy(policy, 1000);
+        test.addProducer(std::make_shared<CProducerSync>(std::bind(&CWeldingCompany::addPriceList, &test, _1, _2)));
+        for (unsigned i = 0; i < CUSTOMERS; i++)
+            test.addCustomer(std::make_shared<CThrottleCustomer>(probe, DEMANDS, policy == AdmissionPolicy::REJECT));
+        test.start(WORKERS);
+        test.stop();
+
+        ThrottleStats st = test.throttleStats();
+        int bound = (int)(ORDER_CAP + WORKERS + COMPLETED_CAP + 1);
+        bool bounded = probe.maxOutstanding <= bound + (policy == AdmissionPolicy::REJECT ? (int)BIG : 0);
+        bool counted = st.receiverWaits > 0 && st.completedWaits > 0
+                       && st.rejected == (policy == AdmissionPolicy::REJECT ? BIG : 0)
+                       && st.deferred == (policy == AdmissionPolicy::DEFER ? BIG : 0);
+        if (!bounded || !counted || probe.wrongCosts || probe.completedLists != (int)(CUSTOMERS * DEMANDS)) {
+            printf("  policy %d: max outstanding %d (bound %d), %d wrong costs, %d completed, stats %zu/%zu/%zu/%zu\n",
+                   (int)policy, probe.maxOutstanding.load(), bound, probe.wrongCosts.load(),
+                   probe.completedLists.load(), st.receiverWaits, st.completedWaits, st.rejected, st.deferred);
+            ok = false;
+        }
+    }
+    printf("testThrottling, status = %s\n", ok ? "OK" : "fail");
+    return ok;
+}
+
+// runs the sample scenario with every producer/customer call logged to a trace
+static int recordTrace(const char *path) {
+    using namespace std::placeholders;
+    CWeldingCompany test;
+    CTraceRecorder recorder;
+    auto receiver = std::bind(&CWeldingCompany::addPriceList, &test, _1, _2);
+    auto r1 = recorder.wrapProducer(receiver);
+    r1->attach(std::make_shared<CProducerSync>(r1->receiver()));
+    auto r2 = recorder.wrapProducer(receiver);
+    AProducerAsync p2 = std::make_shared<CProducerAsync>(r2->receiver());
+    r2->attach(p2);
+
+    test.addProducer(r1);
+    test.addProducer(r2);
+    test.addCustomer(recorder.wrapCustomer(std::make_shared<CCustomerTest>(2)));
+    p2->start();
+    test.start(3);
+    test.stop();
+    p2->stop();
+    return recorder.save(path) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int replayTrace(const char *path, double speed, unsigned thrCount) {
+    using namespace std::placeholders;
+    CTrace trace;
+    if (!trace.load(path)) {
+        fprintf(stderr, "cannot load trace %s\n", path);
+        return EXIT_FAILURE;
+    }
+    CWeldingCompany test;
+    CTraceReplay replay(trace, speed);
+    for (auto &p : replay.createProducers(std::bind(&CWeldingCompany::addPriceList, &test, _1, _2)))
+        test.addProducer(p);
+    for (auto &c : replay.createCustomers())
+        test.addCustomer(c);
+    replay.begin();
+    test.start(thrCount);
+    test.stop();
+    replay.end();
+    replay.printReport(stdout);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc >= 3 && strcmp(argv[1], "record") == 0)
+        return recordTrace(argv[2]);
+    if (argc >= 3 && strcmp(argv[1], "replay") == 0)
+        return replayTrace(argv[2], argc >= 4 ? atof(argv[3]) : 1.0, argc >= 5 ? atoi(argv[4]) : 3);
+
+    if (!testSolverPaths(3000) || !testSparsePaths(600) || !testSnapshot() || !testTraceLoad() || !testThrottling())
+        return EXIT_FAILURE;
+
     using namespace std::placeholders;
     CWeldingCompany test;
     AProducer p1 = std::make_shared<CProducerSync>(
@@ -0,0 +1,444 @@
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include "trace_replay.h"
+
+static constexpr char TRACE_MAGIC[8] = {'W', 'E', 'L', 'D', 'T', 'R', 'C', '1'};
+
+struct CTraceFileHeader {
+    char m_Magic[8];
+    uint32_t m_Producers;
+    uint32_t m_Customers;
+    uint64_t m_EventCount;
+};
+
+// producer currently executing sendPriceList on this thread, used to tell sync responses apart
+static thread_local const CProducer *t_InSend = nullptr;
+
+//=============================================================================================================================================================
+bool CTrace::save(const char *path) const {
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+        return false;
+    CTraceFileHeader hdr{};
+    memcpy(hdr.m_Magic, TRACE_MAGIC, sizeof(hdr.m_Magic));
+    hdr.m_Producers = m_Producers;
+    hdr.m_Customers = m_Customers;
+    hdr.m_EventCount = m_Events.size();
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+    for (size_t i = 0; ok && i < m_Events.size(); i++) {
+        const CTraceEvent &ev = m_Events[i];
+        ok = fwrite(&ev.m_Rec, sizeof(ev.m_Rec), 1, fp) == 1
+             && fwrite(ev.m_Items.data(), sizeof(CTraceItem), ev.m_Items.size(), fp) == ev.m_Items.size();
+    }
+    return (fclose(fp) == 0) && ok;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+bool CTrace::load(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+    // every count is checked against the bytes left in the file before anything is allocated for it
+    long fileSize = -1;
+    if (fseek(fp, 0, SEEK_END) == 0)
+        fileSize = ftell(fp);
+    CTraceFileHeader hdr;
+    bool ok = fileSize >= (long)sizeof(hdr) && fseek(fp, 0, SEEK_SET) == 0
+              && fread(&hdr, sizeof(hdr), 1, fp) == 1 && memcmp(hdr.m_Magic, TRACE_MAGIC, sizeof(hdr.m_Magic)) == 0;
+    uint64_t remaining = ok ? (uint64_t)fileSize - sizeof(hdr) : 0;
+    ok = ok && hdr.m_EventCount <= remaining / sizeof(CTraceRecord);
+    std::vector<CTraceEvent> events;
+    if (ok)
+        events.reserve(hdr.m_EventCount);
+    for (uint64_t i = 0; ok && i < hdr.m_EventCount; i++) {
+        CTraceEvent ev;
+        ok = remaining >= sizeof(ev.m_Rec) && fread(&ev.m_Rec, sizeof(ev.m_Rec), 1, fp) == 1;
+        if (!ok)
+            break;
+        remaining -= sizeof(ev.m_Rec);
+        ok = ev.m_Rec.m_ItemCount <= remaining / sizeof(CTraceItem);
+        if (!ok)
+            break;
+        ev.m_Items.resize(ev.m_Rec.m_ItemCount);
+        ok = fread(ev.m_Items.data(), sizeof(CTraceItem), ev.m_Items.size(), fp) == ev.m_Items.size();
+        remaining -= ev.m_Items.size() * sizeof(CTraceItem);
+        events.push_back(std::move(ev));
+    }
+    fclose(fp);
+    if (ok) {
+        m_Producers = hdr.m_Producers;
+        m_Customers = hdr.m_Customers;
+        m_Events = std::move(events);
+    }
+    return ok;
+}
+
+//=============================================================================================================================================================
+CTraceRecorder::CTraceRecorder()
+        : m_Start(std::chrono::steady_clock::now()) {
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+std::shared_ptr<CRecordingProducer> CTraceRecorder::wrapProducer(std::function<void(AProducer, APriceList)> receiver) {
+    std::lock_guard locker(m_Mtx);
+    return std::make_shared<CRecordingProducer>(*this, m_Trace.m_Producers++, receiver);
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+std::shared_ptr<CRecordingCustomer> CTraceRecorder::wrapCustomer(ACustomer inner) {
+    std::lock_guard locker(m_Mtx);
+    return std::make_shared<CRecordingCustomer>(*this, m_Trace.m_Customers++, inner);
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+bool CTraceRecorder::save(const char *path) {
+    std::lock_guard locker(m_Mtx);
+    return m_Trace.save(path);
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void CTraceRecorder::record(uint8_t type, uint8_t flags, unsigned actor, unsigned materialID, uint32_t seq,
+                            std::vector<CTraceItem> items) {
+    CTraceEvent ev;
+    ev.m_Rec.m_Type = type;
+    ev.m_Rec.m_Flags = flags;
+    ev.m_Rec.m_Actor = (uint16_t)actor;
+    ev.m_Rec.m_MaterialID = materialID;
+    ev.m_Rec.m_Seq = seq;
+    ev.m_Rec.m_ItemCount = (uint32_t)items.size();
+    ev.m_Items = std::move(items);
+    std::lock_guard locker(m_Mtx);
+    ev.m_Rec.m_TimeNs = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - m_Start).count();
+    m_Trace.m_Events.push_back(std::move(ev));
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+uint32_t CTraceRecorder::orderSeq(const COrderList *list, bool assign) {
+    std::lock_guard locker(m_Mtx);
+    if (assign)
+        return m_Seq[list] = m_NextSeq++;
+    auto it = m_Seq.find(list);
+    return it == m_Seq.end() ? UINT32_MAX : it->second;
+}
+
+//=============================================================================================================================================================
+std::function<void(AProducer, APriceList)> CRecordingProducer::receiver() {
+    return [this](AProducer, APriceList list) {
+        if (list) {
+            std::vector<CTraceItem> items;
+            items.reserve(list->m_List.size());
+            for (const auto &x: list->m_List)
+                items.push_back({x.m_W, x.m_H, x.m_Cost, 0});
+            m_Recorder.record(TRACE_ADD_PRICE_LIST, t_InSend == this ? TRACE_FLAG_SYNC : 0, m_Actor,
+                              list->m_MaterialID, 0, std::move(items));
+        }
+        m_Receiver(shared_from_this(), list);
+    };
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void CRecordingProducer::sendPriceList(unsigned materialID) {
+    m_Recorder.record(TRACE_SEND_PRICE_LIST, 0, m_Actor, materialID, 0, {});
+    const CProducer *prev = t_InSend;
+    t_InSend = this;
+    if (m_Inner)
+        m_Inner->sendPriceList(materialID);
+    t_InSend = prev;
+}
+
+//=============================================================================================================================================================
+AOrderList CRecordingCustomer::waitForDemand() {
+    AOrderList list = m_Inner->waitForDemand();
+    if (!list) {
+        m_Recorder.record(TRACE_WAIT_FOR_DEMAND, TRACE_FLAG_END, m_Actor, 0, 0, {});
+        return list;
+    }
+    std::vector<CTraceItem> items;
+    items.reserve(list->m_List.size());
+    for (const auto &x: list->m_List)
+        items.push_back({x.m_W, x.m_H, x.m_WeldingStrength, 0});
+    m_Recorder.record(TRACE_WAIT_FOR_DEMAND, 0, m_Actor, list->m_MaterialID,
+                      m_Recorder.orderSeq(list.get(), true), std::move(items));
+    return list;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void CRecordingCustomer::completed(AOrderList x) {
+    std::vector<CTraceItem> items;
+    items.reserve(x->m_List.size());
+    for (const auto &o: x->m_List)
+        items.push_back({o.m_W, o.m_H, o.m_WeldingStrength, o.m_Cost});
+    m_Recorder.record(TRACE_COMPLETED, 0, m_Actor, x->m_MaterialID, m_Recorder.orderSeq(x.get(), false),
+                      std::move(items));
+    m_Inner->completed(x);
+}
+
+//=============================================================================================================================================================
+static CReplayStats makeStats(std::vector<double> latenciesMs, double spanSec, size_t mismatches) {
+    CReplayStats st;
+    st.m_Orders = latenciesMs.size();
+    st.m_SpanSec = spanSec;
+    st.m_Mismatches = mismatches;
+    if (latenciesMs.empty())
+        return st;
+    std::sort(latenciesMs.begin(), latenciesMs.end());
+    double sum = 0;
+    for (double l: latenciesMs)
+        sum += l;
+    st.m_MeanLatencyMs = sum / latenciesMs.size();
+    st.m_P50LatencyMs = latenciesMs[latenciesMs.size() / 2];
+    st.m_P99LatencyMs = latenciesMs[std::min(latenciesMs.size() - 1, latenciesMs.size() * 99 / 100)];
+    st.m_MaxLatencyMs = latenciesMs.back();
+    return st;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+CTraceReplay::CTraceReplay(const CTrace &trace, double speed)
+        : m_Trace(trace),
+          m_Speed(speed),
+          m_Start(std::chrono::steady_clock::now()) {
+    for (const auto &ev: m_Trace.m_Events)
+        if (ev.m_Rec.m_Type == TRACE_COMPLETED)
+            m_RecordedCompleted[ev.m_Rec.m_Seq] = &ev;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+CTraceReplay::~CTraceReplay() {
+    end();
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+std::vector<AProducer> CTraceReplay::createProducers(std::function<void(AProducer, APriceList)> receiver) {
+    std::vector<AProducer> res;
+    for (unsigned i = 0; i < m_Trace.m_Producers; i++) {
+        m_Producers.push_back(std::make_shared<CReplayProducer>(*this, i, m_Trace, receiver));
+        res.push_back(m_Producers.back());
+    }
+    return res;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+std::vector<ACustomer> CTraceReplay::createCustomers() {
+    std::vector<ACustomer> res;
+    for (unsigned i = 0; i < m_Trace.m_Customers; i++)
+        res.push_back(std::make_shared<CReplayCustomer>(*this, i, m_Trace));
+    return res;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void CTraceReplay::begin() {
+    m_Start = m_FirstIssued = m_LastCompleted = std::chrono::steady_clock::now();
+    for (auto &p: m_Producers)
+        p->start();
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void CTraceReplay::end() {
+    for (auto &p: m_Producers)
+        p->stop();
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+std::chrono::nanoseconds CTraceReplay::scale(uint64_t timeNs) const {
+    if (m_Speed <= 0)
+        return std::chrono::nanoseconds(0);
+    return std::chrono::nanoseconds((int64_t)(timeNs / m_Speed));
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+std::chrono::steady_clock::time_point CTraceReplay::due(uint64_t timeNs) const {
+    return m_Start + scale(timeNs);
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void CTraceReplay::demandIssued(AOrderList list, uint32_t seq) {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard locker(m_Mtx);
+    if (m_Pending.empty() && m_LatenciesMs.empty())
+        m_FirstIssued = now;
+    m_Pending[list.get()] = {seq, now};
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void CTraceReplay::demandCompleted(AOrderList list) {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard locker(m_Mtx);
+    auto it = m_Pending.find(list.get());
+    if (it == m_Pending.end())
+        return;
+    m_LatenciesMs.push_back(std::chrono::duration<double, std::milli>(now - it->second.second).count());
+    m_LastCompleted = std::max(m_LastCompleted, now);
+
+    auto itRec = m_RecordedCompleted.find(it->second.first);
+    if (itRec != m_RecordedCompleted.end()) {
+        const auto &items = itRec->second->m_Items;
+        for (size_t i = 0; i < items.size() && i < list->m_List.size(); i++)
+            if (fabs(items[i].m_B - list->m_List[i].m_Cost) > 1e-5 * items[i].m_B) {
+                m_Mismatches++;
+                break;
+            }
+    }
+    m_Pending.erase(it);
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+CReplayStats CTraceReplay::recordedStats() const {
+    std::unordered_map<uint32_t, uint64_t> issued;
+    uint64_t first = UINT64_MAX, last = 0;
+    std::vector<double> latencies;
+    for (const auto &ev: m_Trace.m_Events) {
+        if (ev.m_Rec.m_Type == TRACE_WAIT_FOR_DEMAND && !(ev.m_Rec.m_Flags & TRACE_FLAG_END)) {
+            issued[ev.m_Rec.m_Seq] = ev.m_Rec.m_TimeNs;
+            first = std::min(first, ev.m_Rec.m_TimeNs);
+        } else if (ev.m_Rec.m_Type == TRACE_COMPLETED) {
+            auto it = issued.find(ev.m_Rec.m_Seq);
+            if (it == issued.end())
+                continue;
+            latencies.push_back((ev.m_Rec.m_TimeNs - it->second) / 1e6);
+            last = std::max(last, ev.m_Rec.m_TimeNs);
+        }
+    }
+    return makeStats(latencies, last > first ? (last - first) / 1e9 : 0, 0);
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+CReplayStats CTraceReplay::replayStats() const {
+    std::lock_guard locker(m_Mtx);
+    return makeStats(m_LatenciesMs, std::chrono::duration<double>(m_LastCompleted - m_FirstIssued).count(), m_Mismatches);
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void CTraceReplay::printReport(FILE *fp) const {
+    CReplayStats rec = recordedStats(), rep = replayStats();
+    fprintf(fp, "%-16s %14s %14s %10s\n", "", "recorded", "replay", "ratio");
+    auto row = [fp](const char *name, double a, double b) {
+        fprintf(fp, "%-16s %14.3f %14.3f %10.3f\n", name, a, b, a > 0 ? b / a : 0.0);
+    };
+    row("orders", (double)rec.m_Orders, (double)rep.m_Orders);
+    row("span [s]", rec.m_SpanSec, rep.m_SpanSec);
+    row("orders/s", rec.throughput(), rep.throughput());
+    row("mean lat [ms]", rec.m_MeanLatencyMs, rep.m_MeanLatencyMs);
+    row("p50 lat [ms]", rec.m_P50LatencyMs, rep.m_P50LatencyMs);
+    row("p99 lat [ms]", rec.m_P99LatencyMs, rep.m_P99LatencyMs);
+    row("max lat [ms]", rec.m_MaxLatencyMs, rep.m_MaxLatencyMs);
+    fprintf(fp, "cost mismatches: %zu\n", rep.m_Mismatches);
+}
+
+//=============================================================================================================================================================
+CReplayProducer::CReplayProducer(CTraceReplay &replay, unsigned actor, const CTrace &trace,
+                                 std::function<void(AProducer, APriceList)> receiver)
+        : m_Replay(replay),
+          m_Receiver(receiver) {
+    // pair the k-th recorded request of a material with the k-th recorded response
+    std::map<unsigned, std::queue<uint64_t>> requested;
+    for (const auto &ev: trace.m_Events) {
+        if (ev.m_Rec.m_Actor != actor)
+            continue;
+        if (ev.m_Rec.m_Type == TRACE_SEND_PRICE_LIST)
+            requested[ev.m_Rec.m_MaterialID].push(ev.m_Rec.m_TimeNs);
+        else if (ev.m_Rec.m_Type == TRACE_ADD_PRICE_LIST) {
+            auto &q = requested[ev.m_Rec.m_MaterialID];
+            uint64_t sent = q.empty() ? ev.m_Rec.m_TimeNs : q.front();
+            if (!q.empty())
+                q.pop();
+            m_Responses[ev.m_Rec.m_MaterialID].push_back(
+                    {ev.m_Rec.m_TimeNs - sent, (ev.m_Rec.m_Flags & TRACE_FLAG_SYNC) != 0, &ev});
+        }
+    }
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void CReplayProducer::start() {
+    std::lock_guard locker(m_Mtx);
+    if (!m_Thr.joinable()) {
+        m_Stop = false;
+        m_Thr = std::thread(&CReplayProducer::prodThr, this);
+    }
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void CReplayProducer::stop() {
+    std::unique_lock locker(m_Mtx);
+    m_Stop = true;
+    m_Cond.notify_one();
+    locker.unlock();
+    if (m_Thr.joinable())
+        m_Thr.join();
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void CReplayProducer::sendPriceList(unsigned materialID) {
+    std::unique_lock locker(m_Mtx);
+    auto it = m_Responses.find(materialID);
+    if (it == m_Responses.end() || it->second.empty())
+        return;
+    size_t idx = std::min(m_Served[materialID]++, it->second.size() - 1);
+    const CResponse &resp = it->second[idx];
+    if (resp.m_Sync) {
+        locker.unlock();
+        deliver(*resp.m_Event);
+        return;
+    }
+    m_Queue.push({std::chrono::steady_clock::now() + m_Replay.scale(resp.m_DelayNs), resp.m_Event});
+    m_Cond.notify_one();
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void CReplayProducer::deliver(const CTraceEvent &ev) {
+    APriceList l = std::make_shared<CPriceList>(ev.m_Rec.m_MaterialID);
+    for (const auto &x: ev.m_Items)
+        l->add(CProd(x.m_W, x.m_H, x.m_A));
+    m_Receiver(shared_from_this(), l);
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void CReplayProducer::prodThr() {
+    std::unique_lock locker(m_Mtx);
+    while (true) {
+        if (m_Stop)
+            break;
+        if (m_Queue.empty()) {
+            m_Cond.wait(locker);
+            continue;
+        }
+        if (std::chrono::steady_clock::now() < m_Queue.top().m_Due) {
+            m_Cond.wait_until(locker, m_Queue.top().m_Due);
+            continue;
+        }
+        CPending next = m_Queue.top();
+        m_Queue.pop();
+        locker.unlock();
+        deliver(*next.m_Event);
+        locker.lock();
+    }
+}
+
+//=============================================================================================================================================================
+CReplayCustomer::CReplayCustomer(CTraceReplay &replay, unsigned actor, const CTrace &trace)
+        : m_Replay(replay) {
+    for (const auto &ev: trace.m_Events)
+        if (ev.m_Rec.m_Type == TRACE_WAIT_FOR_DEMAND && ev.m_Rec.m_Actor == actor
+            && !(ev.m_Rec.m_Flags & TRACE_FLAG_END))
+            m_Demands.push_back(&ev);
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+AOrderList CReplayCustomer::waitForDemand() {
+    if (m_Next >= m_Demands.size())
+        return AOrderList();
+    const CTraceEvent &ev = *m_Demands[m_Next++];
+    std::this_thread::sleep_until(m_Replay.due(ev.m_Rec.m_TimeNs));
+    AOrderList req = std::make_shared<COrderList>(ev.m_Rec.m_MaterialID);
+    for (const auto &x: ev.m_Items)
+        req->add(COrder(x.m_W, x.m_H, x.m_A));
+    m_Replay.demandIssued(req, ev.m_Rec.m_Seq);
+    return req;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void CReplayCustomer::completed(AOrderList x) {
+    m_Replay.demandCompleted(x);
+}
+//=============================================================================================================================================================
@@ -0,0 +1,248 @@
+// Deterministic trace recording and replay of the producer/customer traffic seen by CWeldingCompany.
+// The recorder wraps real producers and customers and logs every interface call with a timestamp.
+// The replay driver feeds a recorded trace back at the recorded (or accelerated) speed and reports
+// how throughput and latency of the current build differ from the recorded run.
+// These classes do not exist in the progtest's testing environment.
+#ifndef TRACE_REPLAY_H_83746529164528374651
+#define TRACE_REPLAY_H_83746529164528374651
+
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "common.h"
+
+//=============================================================================================================================================================
+enum ETraceEvent : uint8_t {
+    TRACE_WAIT_FOR_DEMAND = 1,
+    TRACE_SEND_PRICE_LIST = 2,
+    TRACE_ADD_PRICE_LIST = 3,
+    TRACE_COMPLETED = 4
+};
+
+constexpr uint8_t TRACE_FLAG_SYNC = 1;        // addPriceList delivered from inside sendPriceList
+constexpr uint8_t TRACE_FLAG_END = 2;         // waitForDemand returned no more demands
+
+// on-disk record, followed by m_ItemCount x CTraceItem
+struct CTraceRecord {
+    uint64_t m_TimeNs;
+    uint8_t m_Type;
+    uint8_t m_Flags;
+    uint16_t m_Actor;
+    uint32_t m_MaterialID;
+    uint32_t m_Seq;
+    uint32_t m_ItemCount;
+};
+
+// CProd (a = cost) or COrder (a = welding strength, b = cost)
+struct CTraceItem {
+    uint32_t m_W;
+    uint32_t m_H;
+    double m_A;
+    double m_B;
+};
+
+struct CTraceEvent {
+    CTraceRecord m_Rec;
+    std::vector<CTraceItem> m_Items;
+};
+
+class CTrace {
+public:
+    bool save(const char *path) const;
+
+    bool load(const char *path);
+
+    unsigned m_Producers = 0;
+    unsigned m_Customers = 0;
+    std::vector<CTraceEvent> m_Events;
+};
+
+//=============================================================================================================================================================
+class CTraceRecorder {
+public:
+    CTraceRecorder();
+
+    std::shared_ptr<class CRecordingProducer> wrapProducer(std::function<void(AProducer, APriceList)> receiver);
+
+    std::shared_ptr<class CRecordingCustomer> wrapCustomer(ACustomer inner);
+
+    bool save(const char *path);
+
+    void record(uint8_t type, uint8_t flags, unsigned actor, unsigned materialID, uint32_t seq,
+                std::vector<CTraceItem> items);
+
+    uint32_t orderSeq(const COrderList *list, bool assign);
+
+private:
+    std::chrono::steady_clock::time_point m_Start;
+    std::mutex m_Mtx;
+    CTrace m_Trace;
+    uint32_t m_NextSeq = 0;
+    std::unordered_map<const COrderList *, uint32_t> m_Seq;
+};
+
+class CRecordingProducer : public CProducer {
+public:
+    CRecordingProducer(CTraceRecorder &recorder, unsigned actor,
+                       std::function<void(AProducer, APriceList)> receiver)
+            : m_Recorder(recorder),
+              m_Actor(actor),
+              m_Receiver(receiver) {
+    }
+
+    // receiver to hand to the wrapped producer instead of the company's one
+    std::function<void(AProducer, APriceList)> receiver();
+
+    void attach(AProducer inner) { m_Inner = inner; }
+
+    virtual void sendPriceList(unsigned materialID) override;
+
+private:
+    CTraceRecorder &m_Recorder;
+    unsigned m_Actor;
+    std::function<void(AProducer, APriceList)> m_Receiver;
+    AProducer m_Inner;
+};
+
+class CRecordingCustomer : public CCustomer {
+public:
+    CRecordingCustomer(CTraceRecorder &recorder, unsigned actor, ACustomer inner)
+            : m_Recorder(recorder),
+              m_Actor(actor),
+              m_Inner(inner) {
+    }
+
+    virtual AOrderList waitForDemand() override;
+
+    virtual void completed(AOrderList x) override;
+
+private:
+    CTraceRecorder &m_Recorder;
+    unsigned m_Actor;
+    ACustomer m_Inner;
+};
+
+//=============================================================================================================================================================
+struct CReplayStats {
+    size_t m_Orders = 0;
+    size_t m_Mismatches = 0;
+    double m_SpanSec = 0;
+    double m_MeanLatencyMs = 0;
+    double m_P50LatencyMs = 0;
+    double m_P99LatencyMs = 0;
+    double m_MaxLatencyMs = 0;
+
+    double throughput() const { return m_SpanSec > 0 ? m_Orders / m_SpanSec : 0; }
+};
+
+class CTraceReplay {
+public:
+    /**
+     * @param[in] trace          recorded trace
+     * @param[in] speed          time acceleration, 1 = recorded speed, 0 = as fast as possible
+     */
+    CTraceReplay(const CTrace &trace, double speed);
+
+    ~CTraceReplay();
+
+    std::vector<AProducer> createProducers(std::function<void(AProducer, APriceList)> receiver);
+
+    std::vector<ACustomer> createCustomers();
+
+    void begin();
+
+    void end();
+
+    CReplayStats recordedStats() const;
+
+    CReplayStats replayStats() const;
+
+    void printReport(FILE *fp) const;
+
+    // recorded duration converted to replay time
+    std::chrono::nanoseconds scale(uint64_t timeNs) const;
+
+    // time point at which an event recorded at timeNs is due in this replay
+    std::chrono::steady_clock::time_point due(uint64_t timeNs) const;
+
+    void demandIssued(AOrderList list, uint32_t seq);
+
+    void demandCompleted(AOrderList list);
+
+private:
+    const CTrace &m_Trace;
+    double m_Speed;
+    std::chrono::steady_clock::time_point m_Start;
+    std::vector<std::shared_ptr<class CReplayProducer>> m_Producers;
+    mutable std::mutex m_Mtx;
+    std::unordered_map<const COrderList *, std::pair<uint32_t, std::chrono::steady_clock::time_point>> m_Pending;
+    std::unordered_map<uint32_t, const CTraceEvent *> m_RecordedCompleted;
+    std::vector<double> m_LatenciesMs;
+    std::chrono::steady_clock::time_point m_FirstIssued;
+    std::chrono::steady_clock::time_point m_LastCompleted;
+    size_t m_Mismatches = 0;
+};
+
+class CReplayProducer : public CProducer {
+public:
+    CReplayProducer(CTraceReplay &replay, unsigned actor, const CTrace &trace,
+                    std::function<void(AProducer, APriceList)> receiver);
+
+    virtual void sendPriceList(unsigned materialID) override;
+
+    void start();
+
+    void stop();
+
+private:
+    struct CResponse {
+        uint64_t m_DelayNs;
+        bool m_Sync;
+        const CTraceEvent *m_Event;
+    };
+
+    struct CPending {
+        std::chrono::steady_clock::time_point m_Due;
+        const CTraceEvent *m_Event;
+
+        bool operator<(const CPending &o) const { return m_Due > o.m_Due; }
+    };
+
+    CTraceReplay &m_Replay;
+    std::function<void(AProducer, APriceList)> m_Receiver;
+    std::map<unsigned, std::vector<CResponse>> m_Responses;
+    std::map<unsigned, size_t> m_Served;
+    std::thread m_Thr;
+    std::mutex m_Mtx;
+    std::condition_variable m_Cond;
+    std::priority_queue<CPending> m_Queue;
+    bool m_Stop = false;
+
+    void deliver(const CTraceEvent &ev);
+
+    void prodThr();
+};
+
+class CReplayCustomer : public CCustomer {
+public:
+    CReplayCustomer(CTraceReplay &replay, unsigned actor, const CTrace &trace);
+
+    virtual AOrderList waitForDemand() override;
+
+    virtual void completed(AOrderList x) override;
+
+private:
+    CTraceReplay &m_Replay;
+    std::vector<const CTraceEvent *> m_Demands;
+    size_t m_Next = 0;
+};
+
+#endif /* TRACE_REPLAY_H_83746529164528374651 */
@@ -0,0 +1,317 @@
+/* Filesystem benchmark.
+ *
+ * Runs a fixed workload on fresh images of several sizes (8 MiB ... 1 GiB, mmap-backed) and reports
+ * sequential/random throughput per request size, small-file create/delete rates, mount/umount time,
+ * allocation among thousands of free runs and fragmentation after churn. Every figure is followed by
+ * the m_Read/m_Write calls and sectors one operation cost on average, and by the median/p99 device-call
+ * latency.
+ *
+ * usage: fsbench [-t trace.bin] [image size in MiB ...]      (default 8 64 256 1024)
+ *        -t logs every device call of the run for fstrace
+ */
+#define FS_BENCHMARK
+
+#include "main.cpp"
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+static const char *IMAGE_PATH = "fsbench.img";
+
+static const char *g_TracePath = nullptr;
+static CInstrumentedBlkDev *g_Dev = nullptr;
+
+//-------------------------------------------------------------------------------------------------
+class CMeasure {
+public:
+    CMeasure() : m_Start(std::chrono::steady_clock::now()) { g_Dev->reset(); }
+
+    double seconds() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_Start).count();
+    }
+
+    // value + per-operation device cost + device latency over all calls of the measurement
+    void report(const char *name, double value, const char *unit, size_t ops) const {
+        BlkDevStats st = g_Dev->stats();
+        double n = ops ? static_cast<double>(ops) : 1.0;
+        BlkDirStats all = st.read;
+        all.calls += st.write.calls;
+        for (int b = 0; b < BLK_LATENCY_BUCKETS; b++)
+            all.latency[b] += st.write.latency[b];
+        printf("  %-30s %11.2f %-6s %9.2f %10.1f %9.2f %10.1f %9llu %9llu\n", name, value, unit,
+               st.read.calls / n, st.read.sectors / n, st.write.calls / n, st.write.sectors / n,
+               (unsigned long long) all.percentileNs(0.5), (unsigned long long) all.percentileNs(0.99));
+    }
+
+private:
+    std::chrono::steady_clock::time_point m_Start;
+};
+
+static void fillPattern(std::vector<uint8_t> &buf, size_t seed) {
+    for (size_t i = 0; i < buf.size(); ++i)
+        buf[i] = static_cast<uint8_t>(seed + i * 7 + (i >> 9));
+}
+
+//-------------------------------------------------------------------------------------------------
+static void benchThroughput(CFileSystem *fs, size_t fileBytes) {
+    static const size_t REQ_SIZES[] = {SECTOR_SIZE, 4096, 64 * 1024, 1024 * 1024};
+    std::mt19937_64 rng(7);
+    char name[64];
+
+    for (size_t req : REQ_SIZES) {
+        std::vector<uint8_t> buf(req);
+        fillPattern(buf, req);
+        size_t ops = fileBytes / req;
+        double mib = static_cast<double>(ops * req) / (1024 * 1024);
+
+        {
+            CMeasure m;
+            int fd = fs->openFile("seq", true);
+            for (size_t i = 0; i < ops; ++i)
+                fs->writeFile(fd, buf.data(), req);
+            fs->closeFile(fd);
+            snprintf(name, sizeof(name), "seq write %zu B", req);
+            m.report(name, mib / m.seconds(), "MiB/s", ops);
+        }
+        {
+            CMeasure m;
+            int fd = fs->openFile("seq", false);
+            for (size_t i = 0; i < ops; ++i)
+                fs->readFile(fd, buf.data(), req);
+            fs->closeFile(fd);
+            snprintf(name, sizeof(name), "seq read %zu B", req);
+            m.report(name, mib / m.seconds(), "MiB/s", ops);
+        }
+
+        // random requests stay inside the file written above, on the same descriptor for writes
+        size_t randOps = ops < 4000 ? ops : 4000;
+        double randMib = static_cast<double>(randOps * req) / (1024 * 1024);
+        int fd = fs->openFile("rand", true);
+        for (size_t i = 0; i < ops; ++i)
+            fs->writeFile(fd, buf.data(), req);
+        {
+            CMeasure m;
+            for (size_t i = 0; i < randOps; ++i)
+                fs->pwriteFile(fd, buf.data(), req, rng() % (fileBytes - req + 1));
+            fs->closeFile(fd);
+            snprintf(name, sizeof(name), "rand write %zu B", req);
+            m.report(name, randMib / m.seconds(), "MiB/s", randOps);
+        }
+        {
+            CMeasure m;
+            fd = fs->openFile("rand", false);
+            for (size_t i = 0; i < randOps; ++i)
+                fs->preadFile(fd, buf.data(), req, rng() % (fileBytes - req + 1));
+            fs->closeFile(fd);
+            snprintf(name, sizeof(name), "rand read %zu B", req);
+            m.report(name, randMib / m.seconds(), "MiB/s", randOps);
+        }
+    }
+    fs->deleteFile("seq");
+    fs->deleteFile("rand");
+}
+
+// creates count files of 1 KiB, remounts, deletes them again; returns the remounted filesystem
+static CFileSystem *benchSmallFiles(CFileSystem *fs, const TBlkDev &dev, size_t count) {
+    std::vector<uint8_t> buf(1024);
+    fillPattern(buf, 3);
+    char name[FILENAME_LEN_MAX + 1];
+    {
+        CMeasure m;
+        for (size_t i = 0; i < count; ++i) {
+            snprintf(name, sizeof(name), "small_%zu", i);
+            int fd = fs->openFile(name, true);
+            fs->writeFile(fd, buf.data(), buf.size());
+            fs->closeFile(fd);
+        }
+        m.report("create 1 KiB files", count / m.seconds(), "ops/s", count);
+    }
+    {
+        CMeasure m;
+        fs->umount();
+        delete fs;
+        m.report("umount (small files)", m.seconds() * 1000, "ms", 1);
+    }
+    {
+        CMeasure m;
+        fs = CFileSystem::mount(dev);
+        m.report("mount (small files)", m.seconds() * 1000, "ms", 1);
+    }
+    {
+        CMeasure m;
+        for (size_t i = 0; i < count; ++i) {
+            snprintf(name, sizeof(name), "small_%zu", i);
+            fs->deleteFile(name);
+        }
+        m.report("delete 1 KiB files", count / m.seconds(), "ops/s", count);
+    }
+    return fs;
+}
+
+/* Leaves `holes` single-sector holes in front of the free space, then creates count files of 4 KiB. None of
+ * them can continue a previous extent, so every first allocation is a best-fit search among all free runs.
+ */
+static void benchFragmented(CFileSystem *fs, size_t holes, size_t count) {
+    std::vector<uint8_t> buf(4096);
+    fillPattern(buf, 9);
+    char name[FILENAME_LEN_MAX + 1];
+    for (size_t i = 0; i < 2 * holes; ++i) {
+        snprintf(name, sizeof(name), "hole_%zu", i);
+        int fd = fs->openFile(name, true);
+        fs->writeFile(fd, buf.data(), SECTOR_SIZE);
+        fs->closeFile(fd);
+    }
+    for (size_t i = 1; i < 2 * holes; i += 2) {
+        snprintf(name, sizeof(name), "hole_%zu", i);
+        fs->deleteFile(name);
+    }
+    {
+        CMeasure m;
+        for (size_t i = 0; i < count; ++i) {
+            snprintf(name, sizeof(name), "after_holes_%zu", i);
+            int fd = fs->openFile(name, true);
+            fs->writeFile(fd, buf.data(), buf.size());
+            fs->closeFile(fd);
+        }
+        snprintf(name, sizeof(name), "create 4 KiB, %zu holes", holes);
+        m.report(name, count / m.seconds(), "ops/s", count);
+    }
+    FsUsageStats st = fs->usageStats();
+    printf("  %-30s %11zu %-6s\n", "free runs", st.freeRuns, "");
+
+    for (size_t i = 0; i < count; ++i) {
+        snprintf(name, sizeof(name), "after_holes_%zu", i);
+        fs->deleteFile(name);
+    }
+    for (size_t i = 0; i < 2 * holes; i += 2) {
+        snprintf(name, sizeof(name), "hole_%zu", i);
+        fs->deleteFile(name);
+    }
+}
+
+// random create/extend/delete until the device has seen several times its capacity, then measures layout
+static void benchChurn(CFileSystem *fs, size_t deviceBytes, size_t maxFiles) {
+    std::mt19937_64 rng(11);
+    std::vector<uint8_t> buf(64 * 1024);
+    fillPattern(buf, 5);
+    std::vector<size_t> sizes(maxFiles, 0);
+    size_t used = 0, written = 0, ops = 0;
+    char name[FILENAME_LEN_MAX + 1];
+
+    CMeasure m;
+    while (written < 3 * deviceBytes) {
+        size_t i = rng() % maxFiles;
+        snprintf(name, sizeof(name), "churn_%zu", i);
+        if (sizes[i] && rng() % 3 == 0) {
+            fs->deleteFile(name);
+            used -= sizes[i];
+            sizes[i] = 0;
+        } else {
+            size_t len = SECTOR_SIZE + rng() % (deviceBytes / 128);
+            if (used + len > deviceBytes / 2)
+                continue;
+            // odd files are rewritten larger each time, leaving holes of their old size behind
+            int fd = fs->openFile(name, true);
+            size_t target = (i & 1) ? sizes[i] + len : len;
+            used = used - sizes[i] + target;
+            sizes[i] = target;
+            for (size_t done = 0; done < target; done += buf.size())
+                fs->writeFile(fd, buf.data(), target - done < buf.size() ? target - done : buf.size());
+            fs->closeFile(fd);
+            written += target;
+        }
+        ops++;
+    }
+    m.report("churn create/delete", ops / m.seconds(), "ops/s", ops);
+
+    FsUsageStats st = fs->usageStats();
+    printf("  %-30s %11.2f %-6s\n", "extents per file", st.files ? double(st.extents) / st.files : 0.0, "");
+    printf("  %-30s %11zu %-6s\n", "free runs", st.freeRuns, "");
+    printf("  %-30s %11.2f %-6s\n", "largest free run", st.freeSectors ? 100.0 * st.largestFreeRun / st.freeSectors : 0.0,
+           "% free");
+}
+
+//-------------------------------------------------------------------------------------------------
+static bool benchImage(size_t mib) {
+    size_t sectors = mib * 1024 * 1024 / SECTOR_SIZE;
+    CMappedBlkDev image;
+    if (!image.open(IMAGE_PATH, sectors, true))
+        return false;
+    CInstrumentedBlkDev instrumented(image.device());
+    g_Dev = &instrumented;
+    if (g_TracePath) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s.%zu", g_TracePath, mib);
+        if (!instrumented.startTrace(path))
+            return false;
+    }
+    TBlkDev dev = instrumented.device();
+
+    printf("\n== %zu MiB image ==\n", mib);
+    printf("  %-30s %11s %-6s %9s %10s %9s %10s %9s %9s\n", "operation", "value", "", "rd/op", "rdsec/op", "wr/op",
+           "wrsec/op", "p50 ns", "p99 ns");
+    {
+        CMeasure m;
+        if (!CFileSystem::createFs(dev))
+            return false;
+        m.report("createFs", m.seconds() * 1000, "ms", 1);
+    }
+    CFileSystem *fs;
+    {
+        CMeasure m;
+        fs = CFileSystem::mount(dev);
+        if (!fs)
+            return false;
+        m.report("mount (empty)", m.seconds() * 1000, "ms", 1);
+    }
+
+    size_t fileBytes = mib * 1024 * 1024 / 4;
+    if (fileBytes > 64 * 1024 * 1024)
+        fileBytes = 64 * 1024 * 1024;
+    benchThroughput(fs, fileBytes);
+
+    size_t dirEntries = sectors / 32;
+    size_t smallFiles = dirEntries / 2 < 2000 ? dirEntries / 2 : 2000;
+    fs = benchSmallFiles(fs, dev, smallFiles);
+    benchFragmented(fs, dirEntries / 2 - smallFiles / 4 < 16384 ? dirEntries / 2 - smallFiles / 4 : 16384, smallFiles / 4);
+    benchChurn(fs, mib * 1024 * 1024, smallFiles);
+
+    {
+        CMeasure m;
+        fs->umount();
+        delete fs;
+        m.report("umount (after churn)", m.seconds() * 1000, "ms", 1);
+    }
+    {
+        CMeasure m;
+        fs = CFileSystem::mount(dev);
+        m.report("mount (after churn)", m.seconds() * 1000, "ms", 1);
+    }
+    fs->umount();
+    delete fs;
+    g_Dev = nullptr;
+    return instrumented.stopTrace();
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<size_t> sizes;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-t") && i + 1 < argc)
+            g_TracePath = argv[++i];
+        else
+            sizes.push_back(strtoul(argv[i], nullptr, 10));
+    }
+    if (sizes.empty())
+        sizes = {8, 64, 256, 1024};
+
+    int res = 0;
+    for (size_t mib : sizes) {
+        if (mib * 1024 * 1024 < DEVICE_SIZE_MIN || mib * 1024 * 1024 > DEVICE_SIZE_MAX || !benchImage(mib)) {
+            printf("%zu MiB: cannot create the image\n", mib);
+            res = 1;
+        }
+    }
+    remove(IMAGE_PATH);
+    return res;
+}
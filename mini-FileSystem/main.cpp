@@ -35,6 +35,273 @@ struct TBlkDev {
 };
 #endif /* __PROGTEST__ */
 
+#include <atomic>
+#include <bit>
+#include <condition_variable>
+#include <mutex>
+#include <shared_mutex>
+#include <set>
+#include <utility>
+
+// one sector run queued on a TAsyncBlkDev; m_Done receives the number of sectors transferred
+struct TIoRequest {
+    bool m_Write;
+    size_t m_Sector;
+    void *m_Data;
+    size_t m_Count;
+    std::function<void(size_t)> m_Done;
+};
+
+/* Optional queued view of the same storage as the TBlkDev: m_Submit takes a whole batch of requests and
+ * returns without waiting for them (false = nothing was queued); m_Done of each request is called once
+ * it completes, typically on a device thread.
+ */
+struct TAsyncBlkDev {
+    std::function<bool(TIoRequest *, size_t)> m_Submit;
+};
+
+#ifndef __PROGTEST__
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// TBlkDev over a memory-mapped image file; image() lets CFileSystem::viewFile hand out pointers into it
+class CMappedBlkDev {
+public:
+    CMappedBlkDev() : m_image(nullptr), m_sectors(0) {}
+
+    ~CMappedBlkDev() { close(); }
+
+    CMappedBlkDev(const CMappedBlkDev &) = delete;
+
+    CMappedBlkDev &operator=(const CMappedBlkDev &) = delete;
+
+    // maps path, which is created or resized to sectors * SECTOR_SIZE bytes when create is set
+    bool open(const char *path, size_t sectors, bool create) {
+        close();
+        int fd = ::open(path, create ? O_RDWR | O_CREAT : O_RDWR, 0644);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if ((create && ftruncate(fd, static_cast<off_t>(sectors * SECTOR_SIZE)) != 0) || fstat(fd, &st) != 0
+            || static_cast<size_t>(st.st_size) != sectors * SECTOR_SIZE) {
+            ::close(fd);
+            return false;
+        }
+        void *mem = mmap(nullptr, sectors * SECTOR_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mem == MAP_FAILED)
+            return false;
+        m_image = static_cast<uint8_t *>(mem);
+        m_sectors = sectors;
+        return true;
+    }
+
+    bool sync() {
+        return !m_image || msync(m_image, m_sectors * SECTOR_SIZE, MS_SYNC) == 0;
+    }
+
+    void close() {
+        if (!m_image)
+            return;
+        sync();
+        munmap(m_image, m_sectors * SECTOR_SIZE);
+        m_image = nullptr;
+        m_sectors = 0;
+    }
+
+    const uint8_t *image() const { return m_image; }
+
+    TBlkDev device() {
+        TBlkDev res;
+        res.m_Sectors = m_sectors;
+        res.m_Read = [this](size_t sec, void *data, size_t n) -> size_t {
+            if (sec + n > m_sectors)
+                return 0;
+            memcpy(data, m_image + sec * SECTOR_SIZE, n * SECTOR_SIZE);
+            return n;
+        };
+        res.m_Write = [this](size_t sec, const void *data, size_t n) -> size_t {
+            if (sec + n > m_sectors)
+                return 0;
+            memcpy(m_image + sec * SECTOR_SIZE, data, n * SECTOR_SIZE);
+            return n;
+        };
+        return res;
+    }
+
+private:
+    uint8_t *m_image;
+    size_t m_sectors;
+};
+
+#include <chrono>
+
+// binary trace written by CInstrumentedBlkDev: a BlkTraceHeader followed by BlkTraceRecords
+struct BlkTraceHeader {
+    char magic[8];              // BLK_TRACE_MAGIC
+    uint64_t sectors;           // device size
+};
+
+struct BlkTraceRecord {
+    uint64_t timeNs;            // call start, relative to startTrace
+    uint32_t latencyNs;
+    uint32_t sector;
+    uint32_t count;
+    uint32_t write;             // 0 = m_Read, 1 = m_Write
+};
+
+static constexpr const char *BLK_TRACE_MAGIC = "BLKTRC1";
+static constexpr int BLK_LATENCY_BUCKETS = 32;  // bucket b: latency in [2^b, 2^(b+1)) ns
+
+struct BlkDirStats {
+    size_t calls;
+    size_t sectors;
+    size_t latency[BLK_LATENCY_BUCKETS];
+
+    // upper bound of the bucket holding the p-th quantile (0 < p <= 1), in ns
+    uint64_t percentileNs(double p) const {
+        size_t want = static_cast<size_t>(p * calls + 0.5), seen = 0;
+        for (int b = 0; b < BLK_LATENCY_BUCKETS; b++)
+            if ((seen += latency[b]) >= want && seen)
+                return UINT64_C(2) << b;
+        return 0;
+    }
+};
+
+struct BlkDevStats {
+    BlkDirStats read;
+    BlkDirStats write;
+};
+
+/* Decorator over any TBlkDev: counts calls and sectors, keeps log2 latency histograms per direction and
+ * optionally logs every call to a binary trace (see fstrace for the offline analysis). Safe to use from
+ * several threads if the wrapped device is.
+ */
+class CInstrumentedBlkDev {
+public:
+    explicit CInstrumentedBlkDev(const TBlkDev &inner) : m_inner(inner), m_trace(nullptr), m_traceCount(0) {
+        reset();
+    }
+
+    ~CInstrumentedBlkDev() { stopTrace(); }
+
+    CInstrumentedBlkDev(const CInstrumentedBlkDev &) = delete;
+
+    CInstrumentedBlkDev &operator=(const CInstrumentedBlkDev &) = delete;
+
+    TBlkDev device() {
+        TBlkDev res;
+        res.m_Sectors = m_inner.m_Sectors;
+        res.m_Read = [this](size_t sec, void *data, size_t n) {
+            auto start = std::chrono::steady_clock::now();
+            size_t done = m_inner.m_Read(sec, data, n);
+            account(m_read, start, sec, n, false);
+            return done;
+        };
+        res.m_Write = [this](size_t sec, const void *data, size_t n) {
+            auto start = std::chrono::steady_clock::now();
+            size_t done = m_inner.m_Write(sec, data, n);
+            account(m_write, start, sec, n, true);
+            return done;
+        };
+        return res;
+    }
+
+    bool startTrace(const char *path) {
+        stopTrace();
+        std::lock_guard<std::mutex> guard(m_traceMutex);
+        m_trace = fopen(path, "wb");
+        if (!m_trace)
+            return false;
+        BlkTraceHeader head{};
+        memcpy(head.magic, BLK_TRACE_MAGIC, sizeof(head.magic));
+        head.sectors = m_inner.m_Sectors;
+        m_traceStart = std::chrono::steady_clock::now();
+        return fwrite(&head, sizeof(head), 1, m_trace) == 1;
+    }
+
+    bool stopTrace() {
+        std::lock_guard<std::mutex> guard(m_traceMutex);
+        if (!m_trace)
+            return true;
+        bool ok = flushTrace();
+        ok = fclose(m_trace) == 0 && ok;
+        m_trace = nullptr;
+        return ok;
+    }
+
+    BlkDevStats stats() const {
+        BlkDevStats st;
+        snapshot(m_read, st.read);
+        snapshot(m_write, st.write);
+        return st;
+    }
+
+    void reset() {
+        for (Counters *c : {&m_read, &m_write}) {
+            c->calls.store(0);
+            c->sectors.store(0);
+            for (auto &b : c->latency)
+                b.store(0);
+        }
+    }
+
+private:
+    struct Counters {
+        std::atomic<size_t> calls;
+        std::atomic<size_t> sectors;
+        std::atomic<size_t> latency[BLK_LATENCY_BUCKETS];
+    };
+
+    static constexpr size_t TRACE_BUFFER = 4096;
+
+    TBlkDev m_inner;
+    Counters m_read, m_write;
+    std::mutex m_traceMutex;
+    FILE *m_trace;
+    std::chrono::steady_clock::time_point m_traceStart;
+    BlkTraceRecord m_traceBuf[TRACE_BUFFER];
+    size_t m_traceCount;
+
+    static void snapshot(const Counters &c, BlkDirStats &out) {
+        out.calls = c.calls.load();
+        out.sectors = c.sectors.load();
+        for (int b = 0; b < BLK_LATENCY_BUCKETS; b++)
+            out.latency[b] = c.latency[b].load();
+    }
+
+    void account(Counters &c, std::chrono::steady_clock::time_point start, size_t sec, size_t n, bool write) {
+        auto end = std::chrono::steady_clock::now();
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        int bucket = ns ? std::bit_width(ns) - 1 : 0;
+        c.calls.fetch_add(1, std::memory_order_relaxed);
+        c.sectors.fetch_add(n, std::memory_order_relaxed);
+        c.latency[bucket < BLK_LATENCY_BUCKETS ? bucket : BLK_LATENCY_BUCKETS - 1].fetch_add(1, std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> guard(m_traceMutex);
+        if (!m_trace)
+            return;
+        BlkTraceRecord &r = m_traceBuf[m_traceCount++];
+        r.timeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(start - m_traceStart).count();
+        r.latencyNs = ns > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(ns);
+        r.sector = static_cast<uint32_t>(sec);
+        r.count = static_cast<uint32_t>(n);
+        r.write = write;
+        if (m_traceCount == TRACE_BUFFER)
+            flushTrace();
+    }
+
+    bool flushTrace() {
+        bool ok = fwrite(m_traceBuf, sizeof(BlkTraceRecord), m_traceCount, m_trace) == m_traceCount;
+        m_traceCount = 0;
+        return ok;
+    }
+};
+#endif /* __PROGTEST__ */
+
 struct FileSysHead {
     char sysVar[8];
     uint32_t filesOccupied;
@@ -42,71 +309,245 @@ struct FileSysHead {
     uint32_t allignmentVar;
 };
 
+// files up to this size keep their data in the directory entry instead of a sector and an index root;
+// 24 bytes make the entry 64 bytes long
+constexpr size_t INLINE_DATA_MAX = 24;
+
+// run of physically contiguous sectors backing file sectors [logical, logical + length)
+struct FileExtent {
+    uint32_t logical;
+    uint32_t start;
+    uint32_t length;
+};
+
 class StartProgramFile {
 public:
     char name[FILENAME_LEN_MAX + 1]{};
     size_t size;
-    size_t *sectorsArray;
+    FileExtent *extents;
+    size_t extentCount;
+    size_t allocatedExtents;
     size_t sectorCount;
-    size_t allocatedSectors;
     bool usedFlag;
     uint32_t rootIB;
+    uint32_t *ibSectors;        // index blocks on disk: root, single-indirect, then the leaves of the deeper trees
+    size_t ibCount;
+    size_t ibCap;
+    uint32_t *ptrSectors;       // pointer blocks of the double-, triple- and quadruple-indirect trees, in pre-order
+    size_t ptrCount;
+    size_t ptrCap;
+    size_t dirtyExtent;         // first extent changed since the last save, SIZE_MAX = clean
+    bool mapLoaded;             // extents/ibSectors are read from disk on first use after mount
+    uint32_t fdMask;            // descriptors open on this file (bit per fd)
+    uint32_t resStart;          // speculative preallocation continuing the last extent, guarded by m_allocMutex;
+    uint32_t resLen;            // marked used in the bitmap, released when the last descriptor closes
+    bool inlined;               // data lives in inlineData and the directory entry, no sectors
+    uint8_t inlineData[INLINE_DATA_MAX];
+    std::shared_mutex lock;     // readers share it, writers/truncate/delete hold it exclusively
 
     StartProgramFile()
-            : size(0), sectorsArray(nullptr), sectorCount(0), allocatedSectors(16), usedFlag(false),
-              rootIB(0xFFFFFFFF) {
+            : size(0), extents(nullptr), extentCount(0), allocatedExtents(4), sectorCount(0), usedFlag(false),
+              rootIB(0xFFFFFFFF), ibSectors(nullptr), ibCount(0), ibCap(0), ptrSectors(nullptr), ptrCount(0),
+              ptrCap(0), dirtyExtent(SIZE_MAX), mapLoaded(true), fdMask(0), resStart(0), resLen(0), inlined(false) {
         memset(name, 0, sizeof(name));
-        sectorsArray = new size_t[allocatedSectors];
-        memset(sectorsArray, 0, allocatedSectors * sizeof(size_t));
+        memset(inlineData, 0, sizeof(inlineData));
+        extents = new FileExtent[allocatedExtents];
+        memset(extents, 0, allocatedExtents * sizeof(FileExtent));
     }
 
     StartProgramFile(const StartProgramFile &other)
-            : size(other.size), sectorCount(other.sectorCount), allocatedSectors(other.allocatedSectors),
-              usedFlag(other.usedFlag), rootIB(other.rootIB) {
+            : size(other.size), extentCount(other.extentCount), allocatedExtents(other.allocatedExtents),
+              sectorCount(other.sectorCount), usedFlag(other.usedFlag), rootIB(other.rootIB),
+              ibSectors(nullptr), ibCount(other.ibCount), ibCap(other.ibCount), ptrSectors(nullptr),
+              ptrCount(other.ptrCount), ptrCap(other.ptrCount), dirtyExtent(other.dirtyExtent),
+              mapLoaded(other.mapLoaded), fdMask(other.fdMask), resStart(other.resStart), resLen(other.resLen),
+              inlined(other.inlined) {
         memcpy(name, other.name, sizeof(name));
-        sectorsArray = new size_t[allocatedSectors];
-        memcpy(sectorsArray, other.sectorsArray, sectorCount * sizeof(size_t));
+        memcpy(inlineData, other.inlineData, sizeof(inlineData));
+        extents = new FileExtent[allocatedExtents];
+        memcpy(extents, other.extents, extentCount * sizeof(FileExtent));
+        if (ibCount) {
+            ibSectors = new uint32_t[ibCap];
+            memcpy(ibSectors, other.ibSectors, ibCount * sizeof(uint32_t));
+        }
+        if (ptrCount) {
+            ptrSectors = new uint32_t[ptrCap];
+            memcpy(ptrSectors, other.ptrSectors, ptrCount * sizeof(uint32_t));
+        }
     }
 
     StartProgramFile &operator=(const StartProgramFile &other) {
         if (this != &other) {
             size = other.size;
+            extentCount = other.extentCount;
+            allocatedExtents = other.allocatedExtents;
             sectorCount = other.sectorCount;
-            allocatedSectors = other.allocatedSectors;
             usedFlag = other.usedFlag;
             memcpy(name, other.name, sizeof(name));
-            delete[] sectorsArray;
-            sectorsArray = new size_t[allocatedSectors];
-            memcpy(sectorsArray, other.sectorsArray, sectorCount * sizeof(size_t));
+            delete[] extents;
+            extents = new FileExtent[allocatedExtents];
+            memcpy(extents, other.extents, extentCount * sizeof(FileExtent));
             rootIB = other.rootIB;
+            delete[] ibSectors;
+            ibSectors = nullptr;
+            ibCount = ibCap = other.ibCount;
+            if (ibCount) {
+                ibSectors = new uint32_t[ibCap];
+                memcpy(ibSectors, other.ibSectors, ibCount * sizeof(uint32_t));
+            }
+            delete[] ptrSectors;
+            ptrSectors = nullptr;
+            ptrCount = ptrCap = other.ptrCount;
+            if (ptrCount) {
+                ptrSectors = new uint32_t[ptrCap];
+                memcpy(ptrSectors, other.ptrSectors, ptrCount * sizeof(uint32_t));
+            }
+            dirtyExtent = other.dirtyExtent;
+            mapLoaded = other.mapLoaded;
+            fdMask = other.fdMask;
+            resStart = other.resStart;
+            resLen = other.resLen;
+            inlined = other.inlined;
+            memcpy(inlineData, other.inlineData, sizeof(inlineData));
         }
         return *this;
     }
 
     ~StartProgramFile() {
-        delete[] sectorsArray;
+        delete[] extents;
+        delete[] ibSectors;
+        delete[] ptrSectors;
     }
 };
 
+static_assert(OPEN_FILES_MAX <= 32, "StartProgramFile::fdMask has one bit per descriptor");
+
+// a descriptor is used by one thread at a time; its buffers are shared with other descriptors of
+// the same file only under that file's lock
 struct ProgramOpenFile {
     StartProgramFile *fileStart;
     size_t tmpPos;
     bool writeFlag;
+    bool appendFlag;        // every write goes to the end of the file
+    bool modifiedFlag;      // this descriptor wrote or truncated the file
     bool openFLag;
+
+    // read-ahead: file sectors [raStart, raStart + raCount) are held in raBuf
+    char *raBuf;
+    size_t raStart;
+    size_t raCount;
+    size_t raWindow;        // sectors fetched by the next refill, 0 = access is not sequential
+    size_t raNext;          // position the next sequential read starts at
+
+    // write buffer: file sectors [wbStart, wbStart + wbCount) not yet written to the device
+    char *wbBuf;
+    size_t wbStart;
+    size_t wbCount;
+    size_t wbDelayed;       // buffered sectors past the allocated end, sectors are assigned on write-back
 };
 
 struct InputFileDir {
     char name[FILENAME_LEN_MAX + 1];
+    uint8_t usedFlag;
+    uint8_t inlineFlag;             // the first `size` bytes of inlineData are the file, mainIndBlock is unused
 
     uint32_t size;
     uint32_t mainIndBlock;
-    uint8_t usedFlag;
+    uint8_t inlineData[INLINE_DATA_MAX];
 };
 
-struct fileBlockID {
-    uint32_t nextBlock;
-    uint32_t tmpID[127];
+// device I/O on a cache slot runs with its shard unlocked; other threads wait for a busy slot on CacheShard::idle
+enum CacheSlotState : uint8_t {
+    CACHE_READY,            // data valid (or the slot is empty)
+    CACHE_LOADING,          // being read from the device, data not valid yet
+    CACHE_WRITING           // dirty data being written back, still readable but not writable
 };
+
+struct CacheSlot {
+    uint32_t sector;        // 0xFFFFFFFF = empty
+    bool dirty;
+    uint8_t state;          // CacheSlotState
+    int prev, next;         // LRU list, most recently used first
+    int hashNext;
+    char data[SECTOR_SIZE];
+};
+
+struct SectorCacheStats {
+    size_t hits;
+    size_t misses;
+    size_t writeBacks;      // dirty sectors written to the device
+};
+
+// the sector cache is split by the low bits of the sector number, every shard has its own lock, LRU and hash
+constexpr size_t CACHE_SHARDS = 8;
+static_assert((CACHE_SHARDS & (CACHE_SHARDS - 1)) == 0, "CACHE_SHARDS is a power of two");
+
+struct CacheShard {
+    mutable std::mutex lock;
+    std::condition_variable idle;    // a busy slot became ready
+    CacheSlot *slots = nullptr;
+    size_t count = 0;
+    int *buckets = nullptr;
+    size_t bucketMask = 0;
+    int lruHead = -1, lruTail = -1;
+    SectorCacheStats stats{0, 0, 0};
+};
+
+// openFile modes; the two-argument openFile is FS_OPEN_READ (false) / FS_OPEN_TRUNCATE (true)
+enum FsOpenMode {
+    FS_OPEN_READ,
+    FS_OPEN_TRUNCATE,       // created if missing, existing data dropped
+    FS_OPEN_APPEND,         // created if missing, data kept, every write goes to the end
+    FS_OPEN_READ_WRITE      // must exist, data kept, reads and overwrites anywhere
+};
+
+struct FsUsageStats {
+    size_t files;
+    size_t extents;         // over all files, 1 per file = no fragmentation
+    size_t freeSectors;
+    size_t freeRuns;        // contiguous free areas
+    size_t largestFreeRun;
+};
+
+// A file's extents live in an inode-style tree: the root block keeps the first ROOT_EXTENTS
+// extents, a single-indirect extent block the next EXTENTS_PER_BLOCK, and double-, triple- and
+// quadruple-indirect pointer trees hold further extent blocks (leaves). Any extent is at most five
+// reads away, and even a file made only of single-sector extents fits the tree.
+constexpr int EXTENTS_PER_BLOCK = 42;
+constexpr int ROOT_EXTENTS = 41;
+constexpr int POINTERS_PER_BLOCK = SECTOR_SIZE / sizeof(uint32_t);
+constexpr int INDIRECT_TREES = 3;
+
+// extent blocks below a pointer block `level` levels above them
+constexpr size_t leavesUnder(int level) {
+    return level ? POINTERS_PER_BLOCK * leavesUnder(level - 1) : 1;
+}
+
+constexpr size_t MAX_FILE_EXTENTS = ROOT_EXTENTS + EXTENTS_PER_BLOCK
+                                    + (leavesUnder(1) + leavesUnder(2) + leavesUnder(3)) * EXTENTS_PER_BLOCK;
+static_assert(MAX_FILE_EXTENTS >= DEVICE_SIZE_MAX / SECTOR_SIZE, "every sector of the device may be its own extent");
+
+struct IndexRoot {
+    uint32_t extentCount;       // extents of the whole file
+    uint32_t indirect;
+    uint32_t doubleIndirect;
+    FileExtent extents[ROOT_EXTENTS];
+    uint32_t tripleIndirect;    // past the extents: roots of smaller files keep the old layout
+    uint32_t quadIndirect;
+};
+static_assert(sizeof(IndexRoot) <= SECTOR_SIZE, "index root must fit one sector");
+
+struct ExtentBlock {
+    uint32_t extentCount;
+    uint32_t reserved;
+    FileExtent extents[EXTENTS_PER_BLOCK];
+};
+static_assert(sizeof(ExtentBlock) == SECTOR_SIZE, "extent block must fill one sector");
+
+struct PointerBlock {
+    uint32_t blocks[POINTERS_PER_BLOCK];
+};
+static_assert(sizeof(PointerBlock) == SECTOR_SIZE, "pointer block must fill one sector");
 // -----------------------------------------------------------
 
 
@@ -123,6 +564,8 @@ public:
 
     int openFile(const char *fileName, bool writeMode);
 
+    int openFile(const char *fileName, FsOpenMode mode);
+
     bool closeFile(int fd);
 
     size_t readFile(int fd, void *data, size_t len);
@@ -135,126 +578,1407 @@ public:
 
     bool findNext(TFile &file);
 
+    // moves the position of fd (whence = SEEK_SET / SEEK_CUR / SEEK_END); returns the new position,
+    // SIZE_MAX on error. Writing past the end fills the gap with zeros.
+    size_t seekFile(int fd, int64_t offset, int whence);
+
+    // positional read/write: the position and the read-ahead state of fd are left unchanged
+    size_t preadFile(int fd, void *data, size_t len, size_t offset);
+
+    size_t pwriteFile(int fd, const void *data, size_t len, size_t offset);
+
+    // sets the size of the file open for writing on fd: shrinking frees only the sectors past the new end,
+    // growing fills with zeros
+    bool truncateFile(int fd, size_t size);
+
+    // preallocates, preferably as one contiguous run, so that the file can grow to `bytes` without further
+    // allocation; the size does not change and the sectors stay with the file until truncation or delete
+    bool reserveFile(int fd, size_t bytes);
+
+    // resizes the write-back sector cache (0 disables it); dirty sectors are written back first
+    bool resizeCache(size_t sectors);
+
+    SectorCacheStats cacheStats() const {
+        SectorCacheStats total{0, 0, 0};
+        for (const CacheShard &sh : m_cacheShards) {
+            std::lock_guard<std::mutex> guard(sh.lock);
+            total.hits += sh.stats.hits;
+            total.misses += sh.stats.misses;
+            total.writeBacks += sh.stats.writeBacks;
+        }
+        return total;
+    }
+
+    // file and free-space fragmentation; reads the index tree of every file not opened since mount
+    FsUsageStats usageStats();
+
+    // enables readFileAsync/writeFileAsync to queue their whole-sector runs on dev in one batch
+    void attachAsyncDevice(const TAsyncBlkDev &dev);
+
+    /* Queued variants of readFile/writeFile: the position moves at once, done(bytes) is called when the data
+     * has been transferred. data must stay valid and the range untouched until then. Without an async device
+     * they run synchronously. Returns false (done is not called) for a bad descriptor.
+     * done runs on a device thread or, if everything finished early, on the caller's before the call returns;
+     * no filesystem lock is held then, so it may queue the next transfer or close the descriptor (not waitAsync).
+     */
+    bool readFileAsync(int fd, void *data, size_t len, std::function<void(size_t)> done);
+
+    bool writeFileAsync(int fd, const void *data, size_t len, std::function<void(size_t)> done);
+
+    // blocks until every queued read/write has completed; umount does this first
+    void waitAsync();
+
+    // image of the mounted device mapped in memory (see CMappedBlkDev), enables viewFile
+    void attachMappedImage(const uint8_t *image) { m_image = image; }
+
+    /* Zero-copy read: points view at file byte offset inside the mapped image and returns how many bytes
+     * are readable there (up to len, EOF or the end of the contiguous run); 0 at EOF, on error or without
+     * an image. Inline files are viewed in their in-memory directory entry. The view is read-only and valid
+     * until the file is written, truncated or deleted.
+     */
+    size_t viewFile(int fd, size_t offset, size_t len, const uint8_t *&view);
+
     ~CFileSystem();
 
 private:
     TBlkDev m_dev;
-    bool *fSectorBit;
+    uint64_t *fSectorBit;        // 1 bit per sector, set = used; padding bits past the device are set
+    uint64_t *fFullWords;        // summary level: bit w set <=> fSectorBit[w] is completely used
     size_t fSectorBitSize;
-
-    StartProgramFile files[DIR_ENTRIES_MAX];
+    size_t fBitWords;
+    size_t m_freeSectors;        // clear bits of fSectorBit
+    size_t m_delayedSectors;     // promised to buffered appends, not yet taken from the bitmap
+    // every free run of fSectorBit as (start, length) and as (length, start); markRange keeps them exact
+    std::set<std::pair<uint32_t, uint32_t>> m_runsByStart;
+    std::set<std::pair<uint32_t, uint32_t>> m_runsBySize;
+
+    StartProgramFile *files;
+    size_t m_dirEntries;         // directory slots, scaled with the device size
+    size_t m_dirSectors;
+    int *m_nameIndex;            // open addressing (linear probing) filename -> slot, -1 = empty
+    size_t m_nameIndexMask;
+    int *m_freeSlots;            // stack of unused slots, lowest on top
+    size_t m_freeCount;
     ProgramOpenFile openedFiles[OPEN_FILES_MAX];
     size_t findfPosition;
     size_t m_nextFree;
 
+    CacheShard m_cacheShards[CACHE_SHARDS];
+
+    static constexpr size_t CACHE_SECTORS_DEFAULT = 64;
+    static constexpr size_t RA_MIN_SECTORS = 4;
+    static constexpr size_t RA_MAX_SECTORS = 64;
+    static constexpr size_t WB_SECTORS = 8;
+    static constexpr size_t WB_DELAYED_SECTORS = 256;    // appends past the allocated end buffer up to this much
+    static constexpr size_t PREALLOC_MIN_SECTORS = 16;
+    static constexpr size_t PREALLOC_MAX_SECTORS = 8192;
+
     static constexpr uint32_t FILE_INPUT_SIZE = 172;
+    static constexpr const char *FS_MAGIC = "MYFS005";
+    static constexpr size_t BITS_PER_BM_SEC = SECTOR_SIZE * 8;
     static constexpr int REC_PER_SEC = SECTOR_SIZE / sizeof(InputFileDir);
+    static constexpr size_t SECTORS_PER_DIR_ENTRY = 32;
+    static constexpr size_t DIR_ENTRIES_LIMIT = 65536;
+    static constexpr size_t DIR_IO_SECTORS = 64;
+
+    // what saveFile has to write: header, directory sectors, bitmap sectors (files track their own extents)
+    bool m_headDirty;
+    std::atomic<uint8_t> *m_dirDirty;    // set by writers holding only their file's lock
+    uint8_t *m_bmDirty;
+
+    /* Lock order: m_dirMutex -> StartProgramFile::lock -> m_allocMutex -> CacheShard::lock.
+     * m_dirMutex guards the directory (names, hash index, free slots, descriptor table, find cursor),
+     * m_allocMutex the bitmap and its dirty flags, each CacheShard::lock its part of the sector cache; no
+     * two shard locks are held at once and none during device I/O. File data moves under the file lock
+     * only, so threads working on different files do their I/O in parallel.
+     */
+    std::mutex m_dirMutex;
+    std::mutex m_allocMutex;
+
+    // one readFileAsync/writeFileAsync call, finished when its last device request completes
+    struct AsyncOp {
+        std::atomic<size_t> pending;
+        std::atomic<size_t> failedAt;    // lowest byte offset that was not transferred, SIZE_MAX = none
+        size_t bytes;
+        std::function<void(size_t)> done;
+    };
+
+    TAsyncBlkDev m_asyncDev;
+    const uint8_t *m_image;
+    std::mutex m_asyncMutex;
+    std::condition_variable m_asyncCond;
+    size_t m_asyncInFlight;
 
 
     bool loadFile();
 
+    bool loadIndexTree(StartProgramFile &f);
+
+    bool appendLoadedExtents(StartProgramFile &f, const FileExtent *ext, size_t count);
+
+    bool ensureMapLoaded(StartProgramFile &f) {
+        return f.mapLoaded || loadIndexTree(f);
+    }
+
     bool saveFile();
 
     int findFileID(const char *fileName);
 
+    static size_t nameHash(const char *name);
+
+    void indexInsert(int slot);
+
+    void indexErase(int slot);
+
+    void rebuildDirIndex();
+
+    static size_t dirSectorsFor(size_t sectors);
+
     int firstFreePosInput();
 
     int firstFreeOpenFile();
 
-    void secArrSearchSpace(StartProgramFile &f, size_t extraCount) {
-        if (f.sectorCount + extraCount <= f.allocatedSectors)
+    void extArrSearchSpace(StartProgramFile &f, size_t extraCount) {
+        if (f.extentCount + extraCount <= f.allocatedExtents)
             return;
 
-        size_t newCap = f.allocatedSectors;
-        while (newCap < (f.sectorCount + extraCount))
+        size_t newCap = f.allocatedExtents;
+        while (newCap < (f.extentCount + extraCount))
             newCap *= 2;
 
-        size_t *newArr = new size_t[newCap];
-        memcpy(newArr, f.sectorsArray, f.sectorCount * sizeof(size_t));
-        memset(newArr + f.sectorCount, 0, (newCap - f.sectorCount) * sizeof(size_t));
+        FileExtent *newArr = new FileExtent[newCap];
+        memcpy(newArr, f.extents, f.extentCount * sizeof(FileExtent));
+        memset(newArr + f.extentCount, 0, (newCap - f.extentCount) * sizeof(FileExtent));
+
+        delete[] f.extents;
+        f.extents = newArr;
+        f.allocatedExtents = newCap;
+    }
+
+    // appends physical sectors [start, start + length) to the file, merging with the last extent if contiguous
+    void appendExtent(StartProgramFile &f, uint32_t start, uint32_t length) {
+        if (f.extentCount > 0) {
+            FileExtent &last = f.extents[f.extentCount - 1];
+            if (last.start + last.length == start) {
+                last.length += length;
+                f.sectorCount += length;
+                if (f.dirtyExtent > f.extentCount - 1)
+                    f.dirtyExtent = f.extentCount - 1;
+                return;
+            }
+        }
+        if (f.dirtyExtent > f.extentCount)
+            f.dirtyExtent = f.extentCount;
+        extArrSearchSpace(f, 1);
+        f.extents[f.extentCount++] = FileExtent{static_cast<uint32_t>(f.sectorCount), start, length};
+        f.sectorCount += length;
+    }
+
+    // physical sector of file sector sectorIdx; runLeft = sectors left in its extent
+    uint32_t physicalSector(const StartProgramFile &f, size_t sectorIdx, size_t &runLeft) const {
+        size_t lo = 0, hi = f.extentCount;
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            if (f.extents[mid].logical <= sectorIdx)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        const FileExtent &e = f.extents[lo];
+        runLeft = e.logical + e.length - sectorIdx;
+        return static_cast<uint32_t>(e.start + (sectorIdx - e.logical));
+    }
+
+    // frees the sectors past the first keepSectors of the file, from the last extent backwards; surplus
+    // index blocks go on the next save
+    void trimExtents(StartProgramFile &f, size_t keepSectors) {
+        std::lock_guard<std::mutex> guard(m_allocMutex);
+        releaseReservation(f);
+        while (f.sectorCount > keepSectors) {
+            FileExtent &last = f.extents[f.extentCount - 1];
+            uint32_t cut = static_cast<uint32_t>(f.sectorCount - keepSectors < last.length
+                                                 ? f.sectorCount - keepSectors : last.length);
+            markRange(last.start + last.length - cut, cut, false);
+            cacheInvalidate(last.start + last.length - cut, cut);
+            last.length -= cut;
+            f.sectorCount -= cut;
+            if (!last.length)
+                f.extentCount--;
+        }
+        size_t changed = f.extentCount ? f.extentCount - 1 : 0;
+        if (f.dirtyExtent > changed)
+            f.dirtyExtent = changed;
+    }
+
+    void freeExtents(StartProgramFile &f) {
+        trimExtents(f, 0);
+    }
+
+    static void pushSector(uint32_t *&arr, size_t &count, size_t &cap, uint32_t sec) {
+        if (count == cap) {
+            cap = cap ? cap * 2 : 4;
+            uint32_t *grown = new uint32_t[cap];
+            if (count)
+                memcpy(grown, arr, count * sizeof(uint32_t));
+            delete[] arr;
+            arr = grown;
+        }
+        arr[count++] = sec;
+    }
 
-        delete[] f.sectorsArray;
-        f.sectorsArray = newArr;
-        f.allocatedSectors = newCap;
+    void pushIndexBlock(StartProgramFile &f, uint32_t sec) {
+        pushSector(f.ibSectors, f.ibCount, f.ibCap, sec);
+    }
+
+    void pushPointerBlock(StartProgramFile &f, uint32_t sec) {
+        pushSector(f.ptrSectors, f.ptrCount, f.ptrCap, sec);
+    }
+
+    void markDirDirty(const StartProgramFile &f) {
+        m_dirDirty[(&f - files) / REC_PER_SEC].store(1, std::memory_order_relaxed);
+    }
+
+    void freeIndexBlocks(StartProgramFile &f, size_t keep);
+
+    bool saveIndexBlocks(StartProgramFile &f);
+
+    bool savePointerBlock(StartProgramFile &f, size_t &idx, int level, size_t firstLeaf, size_t leaves,
+                          size_t changedFrom);
+
+    bool loadPointerBlock(StartProgramFile &f, uint32_t sec, int level, size_t firstLeaf, size_t leaves,
+                          char *leafBuf);
+
+    void buildDirSector(int sec, char *buf) const;
+
+    static size_t bitmapSectors(size_t sectors) {
+        return (sectors + BITS_PER_BM_SEC - 1) / BITS_PER_BM_SEC;
+    }
+
+    bool isUsed(size_t sec) const {
+        return (fSectorBit[sec >> 6] >> (sec & 63)) & 1;
+    }
+
+    void updateSummary(size_t word) {
+        if (fSectorBit[word] == ~UINT64_C(0))
+            fFullWords[word >> 6] |= UINT64_C(1) << (word & 63);
+        else
+            fFullWords[word >> 6] &= ~(UINT64_C(1) << (word & 63));
     }
 
-    bool checkReadMethod(uint32_t sector, void *buffer) {
-        if (m_dev.m_Read(sector, buffer, 1) == 1)
+    void markRange(size_t start, size_t count, bool used);
+
+    void addRun(size_t start, size_t len) {
+        m_runsByStart.emplace(static_cast<uint32_t>(start), static_cast<uint32_t>(len));
+        m_runsBySize.emplace(static_cast<uint32_t>(len), static_cast<uint32_t>(start));
+    }
+
+    void reindexRuns(size_t from, size_t to);
+
+    void rebuildRunIndex();
+
+    size_t findFree(size_t from) const;
+
+    size_t freeRunLength(size_t start, size_t maxLen) const;
+
+    size_t bestFitRun(size_t want, size_t &start) const;
+
+    // m_allocMutex held
+    void releaseReservation(StartProgramFile &f) {
+        if (f.resLen)
+            markRange(f.resStart, f.resLen, false);
+        f.resLen = 0;
+    }
+
+    bool releaseReservations();
+
+    bool delaySectors(size_t count);
+
+    void undelaySectors(size_t count);
+
+    bool checkReadMethod(uint32_t sector, void *buffer, size_t count = 1) {
+        if (m_dev.m_Read(sector, buffer, count) == count)
             return true;
         else
             return false;
     }
 
-    bool checkWriteMethod(uint32_t sector, const void *buffer) {
-        if (m_dev.m_Write(sector, buffer, 1) == 1)
+    bool checkWriteMethod(uint32_t sector, const void *buffer, size_t count = 1) {
+        if (m_dev.m_Write(sector, buffer, count) == count)
             return true;
         else
             return false;
     }
 
 
+
+    CacheShard &cacheShard(uint32_t sector) {
+        return m_cacheShards[sector & (CACHE_SHARDS - 1)];
+    }
+
+    static int cacheLookup(const CacheShard &sh, uint32_t sector);
+
+    static void lruUnlink(CacheShard &sh, int slot);
+
+    static void lruPushFront(CacheShard &sh, int slot);
+
+    static void cacheInsert(CacheShard &sh, int slot, uint32_t sector);
+
+    static void cacheDrop(CacheShard &sh, int slot);
+
+    int cacheVictim(CacheShard &sh, std::unique_lock<std::mutex> &guard, bool &ok);
+
+    bool cachedRead(uint32_t sector, void *buffer);
+
+    bool cachedWrite(uint32_t sector, const void *buffer);
+
+    void cacheInvalidate(uint32_t start, size_t count);
+
+    void cacheOverlay(uint32_t start, void *buffer, size_t count);
+
+    bool flushCache(const StartProgramFile *f = nullptr);
+
+    const char *readAheadSector(ProgramOpenFile &of, size_t sectorIdx, bool sequential);
+
+    void dropReadAhead(const StartProgramFile *f);
+
+    char *writeBufferSector(ProgramOpenFile &of, size_t sectorIdx);
+
+    bool flushWriteBuffer(ProgramOpenFile &of);
+
+    bool flushWriteBuffers(const StartProgramFile *f);
+
+    bool hasBufferedWrites(const StartProgramFile *f) const;
+
+    bool lockForRead(StartProgramFile &f, std::shared_lock<std::shared_mutex> &fileGuard);
+
+    size_t readLocked(StartProgramFile &f, ProgramOpenFile *ra, uint8_t *dst, size_t len, size_t pos);
+
+    size_t writeLocked(int fd, const void *data, size_t len, size_t pos);
+
+    void clipWriteBuffers(const StartProgramFile *f, size_t keepSectors);
+
+    bool moveInline(ProgramOpenFile &of);
+
+    bool moveOutOfInline(ProgramOpenFile &of);
+
+    void dropWriteBuffers(const StartProgramFile *f) {
+        clipWriteBuffers(f, 0);
+    }
+
+    bool growFile(StartProgramFile &f, size_t needSectors, bool speculative = true, size_t *delayed = nullptr);
+
+    AsyncOp *beginAsync(size_t bytes, std::function<void(size_t)> done);
+
+    void asyncFailed(AsyncOp *op, size_t offset);
+
+    void completeAsync(AsyncOp *op);
+
+    bool queueRuns(AsyncOp *op, StartProgramFile &f, bool write, uint8_t *buf, size_t pos, size_t bytes);
+
     bool findAllocFreeSec(uint32_t &outSec);
 
-    void freeIBChain(uint32_t ibSec);
+    bool allocFor(StartProgramFile &f, size_t want, size_t extra, uint32_t &start, uint32_t &length,
+                  size_t *delayed);
+
+    // m_allocMutex held: the first `got` sectors a file receives fulfil what was promised to it
+    void useDelayed(size_t *delayed, size_t got) {
+        if (!delayed)
+            return;
+        size_t used = got < *delayed ? got : *delayed;
+        m_delayedSectors -= used;
+        *delayed -= used;
+    }
+
 
     CFileSystem(const TBlkDev &dev);
 };
 
 
+void CFileSystem::markRange(size_t start, size_t count, bool used) {
+    size_t from = start, total = count;
+    while (count > 0) {
+        size_t word = start >> 6, bit = start & 63;
+        m_bmDirty[word >> 6] = 1;
+        size_t n = 64 - bit < count ? 64 - bit : count;
+        uint64_t mask = (n == 64 ? ~UINT64_C(0) : ((UINT64_C(1) << n) - 1)) << bit;
+        size_t wasUsed = std::popcount(fSectorBit[word] & mask);
+        if (used) {
+            fSectorBit[word] |= mask;
+            m_freeSectors -= n - wasUsed;
+        } else {
+            fSectorBit[word] &= ~mask;
+            m_freeSectors += wasUsed;
+        }
+        updateSummary(word);
+        start += n;
+        count -= n;
+    }
+    reindexRuns(from, from + total);
+}
+
+/* Updates the free-run index after the bits of [from, to) changed. Runs touching the range leave the index;
+ * what they had outside it is still free and only the changed range itself is scanned, so the cost does
+ * not depend on the size of the neighbouring runs.
+ */
+void CFileSystem::reindexRuns(size_t from, size_t to) {
+    if (to > fSectorBitSize)
+        to = fSectorBitSize;
+    if (from >= to)
+        return;
+    size_t lo = from, hi = to;
+    auto it = m_runsByStart.upper_bound({static_cast<uint32_t>(from), UINT32_MAX});
+    if (it != m_runsByStart.begin() && size_t(std::prev(it)->first) + std::prev(it)->second >= from)
+        --it;
+    while (it != m_runsByStart.end() && it->first <= to) {
+        lo = it->first < lo ? it->first : lo;
+        hi = size_t(it->first) + it->second > hi ? size_t(it->first) + it->second : hi;
+        m_runsBySize.erase({it->second, it->first});
+        it = m_runsByStart.erase(it);
+    }
+
+    // [lo, from) and [to, hi) are free, the runs in between follow the new bits
+    size_t runStart = lo, pos = from;
+    while (pos < to) {
+        if (!isUsed(pos))
+            pos += freeRunLength(pos, to - pos);
+        if (pos >= to)
+            break;
+        if (pos > runStart)
+            addRun(runStart, pos - runStart);
+        size_t next = findFree(pos);
+        pos = runStart = next < to ? next : to;
+    }
+    if (hi > runStart)
+        addRun(runStart, hi - runStart);
+}
+
+// rebuilds the free-run index from the bitmap in one pass (after loading it from the device)
+void CFileSystem::rebuildRunIndex() {
+    m_runsByStart.clear();
+    m_runsBySize.clear();
+    for (size_t sec = findFree(0); sec < fSectorBitSize;) {
+        size_t run = freeRunLength(sec, fSectorBitSize);
+        addRun(sec, run);
+        sec = findFree(sec + run);
+    }
+}
+
+// first free sector >= from, fSectorBitSize if there is none
+size_t CFileSystem::findFree(size_t from) const {
+    if (from >= fSectorBitSize)
+        return fSectorBitSize;
+    size_t word = from >> 6;
+    uint64_t freeBits = ~fSectorBit[word] & (~UINT64_C(0) << (from & 63));
+    if (freeBits)
+        return (word << 6) + std::countr_zero(freeBits);
+
+    // skip completely used words through the summary level
+    for (size_t w = word + 1; w < fBitWords;) {
+        size_t sw = w >> 6;
+        uint64_t notFull = ~fFullWords[sw] & (~UINT64_C(0) << (w & 63));
+        if (!notFull) {
+            w = (sw + 1) << 6;
+            continue;
+        }
+        w = (sw << 6) + std::countr_zero(notFull);
+        if (w >= fBitWords)
+            break;
+        return (w << 6) + std::countr_zero(~fSectorBit[w]);
+    }
+    return fSectorBitSize;
+}
+
+// number of free sectors starting at `start` (which must be free), at most maxLen
+size_t CFileSystem::freeRunLength(size_t start, size_t maxLen) const {
+    size_t len = 0;
+    while (len < maxLen && start + len < fSectorBitSize) {
+        size_t pos = start + len;
+        uint64_t bits = fSectorBit[pos >> 6] >> (pos & 63);
+        size_t avail = bits ? std::countr_zero(bits) : 64 - (pos & 63);
+        len += avail;
+        if (bits)
+            break;
+    }
+    return len < maxLen ? len : maxLen;
+}
+
 bool CFileSystem::findAllocFreeSec(uint32_t &tmpSec) {
-    size_t start = m_nextFree;
+    std::lock_guard<std::mutex> guard(m_allocMutex);
+    size_t i = findFree(m_nextFree);
+    if (i >= fSectorBitSize)
+        i = findFree(0);
+    if (i >= fSectorBitSize)
+        return false;
+
+    markRange(i, 1, true);
+    m_nextFree = i + 1;
+    tmpSec = i;
+    return true;
+}
+
 
-    for (size_t i = start; i < fSectorBitSize; ++i) {
-        if (!fSectorBit[i]) {
-            fSectorBit[i] = true;
-            m_nextFree = i + 1;
-            tmpSec = i;
+// best fit: the smallest free run of at least `want` sectors, the largest one if none is that long (lowest
+// start among equals); returns its length
+size_t CFileSystem::bestFitRun(size_t want, size_t &start) const {
+    if (m_runsBySize.empty())
+        return 0;
+    auto it = m_runsBySize.lower_bound({static_cast<uint32_t>(want), 0});
+    if (it == m_runsBySize.end())
+        it = m_runsBySize.lower_bound({m_runsBySize.rbegin()->first, 0});
+    start = it->second;
+    return it->first;
+}
+
+// gives back the speculative preallocations of all files; true if there were any
+bool CFileSystem::releaseReservations() {
+    bool any = false;
+    for (size_t i = 0; i < m_dirEntries; i++)
+        if (files[i].resLen) {
+            releaseReservation(files[i]);
+            any = true;
+        }
+    return any;
+}
+
+// promises count sectors to a buffered append without choosing them; false if the device cannot hold them
+bool CFileSystem::delaySectors(size_t count) {
+    std::lock_guard<std::mutex> guard(m_allocMutex);
+    if (m_freeSectors < m_delayedSectors + count)
+        return false;
+    m_delayedSectors += count;
+    return true;
+}
+
+void CFileSystem::undelaySectors(size_t count) {
+    if (!count)
+        return;
+    std::lock_guard<std::mutex> guard(m_allocMutex);
+    m_delayedSectors -= count;
+}
 
+/* Hands f a run of up to `want` sectors: from its preallocation, continuing its last extent, or from the
+ * best-fitting free run. Up to `extra` more sectors of that run become f's new preallocation, so that
+ * files written side by side grow in separate regions instead of interleaving. *delayed sectors promised
+ * to f's buffered appends (delaySectors) are turned into the run under the same lock and deducted.
+ */
+bool CFileSystem::allocFor(StartProgramFile &f, size_t want, size_t extra, uint32_t &start, uint32_t &length,
+                           size_t *delayed) {
+    if (want == 0)
+        return false;
+    std::lock_guard<std::mutex> guard(m_allocMutex);
+    if (f.resLen) {
+        start = f.resStart;
+        length = static_cast<uint32_t>(want < f.resLen ? want : f.resLen);
+        f.resStart += length;
+        f.resLen -= length;
+        useDelayed(delayed, length);
+        return true;
+    }
+
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        // sectors promised to other buffered appends are not up for grabs, f's own are
+        size_t avail = m_freeSectors - m_delayedSectors + (delayed ? *delayed : 0);
+        size_t take = want < avail ? want : avail;
+        size_t limit = take + (avail - take < extra ? avail - take : extra);
+        size_t runStart = 0, runLen = 0;
+        if (take > 0 && f.extentCount > 0) {
+            size_t hint = f.extents[f.extentCount - 1].start + f.extents[f.extentCount - 1].length;
+            if (hint < fSectorBitSize && !isUsed(hint)) {
+                runStart = hint;
+                runLen = freeRunLength(hint, limit);
+            }
+        }
+        if (take > 0 && runLen < take) {
+            size_t fitStart, fitLen = bestFitRun(limit, fitStart);
+            if (fitLen > runLen) {
+                runStart = fitStart;
+                runLen = fitLen < limit ? fitLen : limit;
+            }
+        }
+        if (runLen > 0) {
+            size_t got = runLen < take ? runLen : take;
+            markRange(runStart, runLen, true);
+            m_nextFree = runStart + runLen;
+            f.resStart = static_cast<uint32_t>(runStart + got);
+            f.resLen = static_cast<uint32_t>(runLen - got);
+            start = static_cast<uint32_t>(runStart);
+            length = static_cast<uint32_t>(got);
+            useDelayed(delayed, got);
             return true;
         }
+        // the device is full: take back what other writers hold speculatively
+        if (!releaseReservations())
+            break;
     }
+    return false;
+}
 
 
-    for (size_t i = 0; i < start; ++i) {
-        if (!fSectorBit[i]) {
-            fSectorBit[i] = true;
-            m_nextFree = i + 1;
-            tmpSec = i;
+//---------------------------------------------------------------------------
+int CFileSystem::cacheLookup(const CacheShard &sh, uint32_t sector) {
+    if (!sh.count)
+        return -1;
+    for (int i = sh.buckets[(sector / CACHE_SHARDS) & sh.bucketMask]; i >= 0; i = sh.slots[i].hashNext)
+        if (sh.slots[i].sector == sector)
+            return i;
+    return -1;
+}
 
+void CFileSystem::lruUnlink(CacheShard &sh, int slot) {
+    CacheSlot &c = sh.slots[slot];
+    if (c.prev >= 0) sh.slots[c.prev].next = c.next; else sh.lruHead = c.next;
+    if (c.next >= 0) sh.slots[c.next].prev = c.prev; else sh.lruTail = c.prev;
+    c.prev = c.next = -1;
+}
+
+void CFileSystem::lruPushFront(CacheShard &sh, int slot) {
+    CacheSlot &c = sh.slots[slot];
+    c.prev = -1;
+    c.next = sh.lruHead;
+    if (sh.lruHead >= 0) sh.slots[sh.lruHead].prev = slot; else sh.lruTail = slot;
+    sh.lruHead = slot;
+}
+
+// an empty slot takes `sector` (not loaded yet) and becomes the most recently used one
+void CFileSystem::cacheInsert(CacheShard &sh, int slot, uint32_t sector) {
+    CacheSlot &c = sh.slots[slot];
+    c.sector = sector;
+    c.dirty = false;
+    int &bucket = sh.buckets[(sector / CACHE_SHARDS) & sh.bucketMask];
+    c.hashNext = bucket;
+    bucket = slot;
+    lruUnlink(sh, slot);
+    lruPushFront(sh, slot);
+}
+
+void CFileSystem::cacheDrop(CacheShard &sh, int slot) {
+    CacheSlot &c = sh.slots[slot];
+    int *link = &sh.buckets[(c.sector / CACHE_SHARDS) & sh.bucketMask];
+    while (*link != slot)
+        link = &sh.slots[*link].hashNext;
+    *link = c.hashNext;
+    c.hashNext = -1;
+    c.sector = 0xFFFFFFFF;
+    c.dirty = false;
+    // empty slots are reused first: move to the LRU end
+    lruUnlink(sh, slot);
+    c.prev = sh.lruTail;
+    c.next = -1;
+    if (sh.lruTail >= 0) sh.slots[sh.lruTail].next = slot; else sh.lruHead = slot;
+    sh.lruTail = slot;
+}
+
+/* An empty slot for a new sector: the least recently used idle one, dropped. A dirty victim is written back
+ * first with the shard unlocked; then, like when every slot is busy, -1 tells the caller to look its sector
+ * up again, and ok turns false if the write-back failed.
+ */
+int CFileSystem::cacheVictim(CacheShard &sh, std::unique_lock<std::mutex> &guard, bool &ok) {
+    int slot = sh.lruTail;
+    while (slot >= 0 && sh.slots[slot].state != CACHE_READY)
+        slot = sh.slots[slot].prev;
+    if (slot < 0) {
+        sh.idle.wait(guard);
+        return -1;
+    }
+    CacheSlot &c = sh.slots[slot];
+    if (!c.dirty) {
+        if (c.sector != 0xFFFFFFFF)
+            cacheDrop(sh, slot);
+        return slot;
+    }
+    c.state = CACHE_WRITING;
+    guard.unlock();
+    bool written = checkWriteMethod(c.sector, c.data);
+    guard.lock();
+    c.state = CACHE_READY;
+    if (written) {
+        c.dirty = false;
+        sh.stats.writeBacks++;
+    }
+    ok = written;
+    sh.idle.notify_all();
+    return -1;
+}
+
+bool CFileSystem::cachedRead(uint32_t sector, void *buffer) {
+    CacheShard &sh = cacheShard(sector);
+    std::unique_lock<std::mutex> guard(sh.lock);
+    bool ok = true;
+    int slot = -1;
+    while (ok && slot < 0) {
+        if (!sh.count) {
+            // no cache, or resizeCache disabled it while this thread waited
+            guard.unlock();
+            return checkReadMethod(sector, buffer);
+        }
+        slot = cacheLookup(sh, sector);
+        if (slot >= 0 && sh.slots[slot].state == CACHE_LOADING) {
+            // another thread is reading the sector already
+            sh.idle.wait(guard);
+            slot = -1;
+        } else if (slot >= 0) {
+            sh.stats.hits++;
+            lruUnlink(sh, slot);
+            lruPushFront(sh, slot);
+        } else if ((slot = cacheVictim(sh, guard, ok)) >= 0) {
+            sh.stats.misses++;
+            CacheSlot &c = sh.slots[slot];
+            cacheInsert(sh, slot, sector);
+            c.state = CACHE_LOADING;
+            guard.unlock();
+            bool read = checkReadMethod(sector, c.data);
+            guard.lock();
+            c.state = CACHE_READY;
+            sh.idle.notify_all();
+            if (!read) {
+                cacheDrop(sh, slot);
+                return false;
+            }
+        }
+    }
+    if (!ok)
+        return false;
+    memcpy(buffer, sh.slots[slot].data, SECTOR_SIZE);
+    return true;
+}
+
+bool CFileSystem::cachedWrite(uint32_t sector, const void *buffer) {
+    CacheShard &sh = cacheShard(sector);
+    std::unique_lock<std::mutex> guard(sh.lock);
+    bool ok = true;
+    int slot = -1;
+    while (ok && slot < 0) {
+        if (!sh.count) {
+            // no cache, or resizeCache disabled it while this thread waited
+            guard.unlock();
+            return checkWriteMethod(sector, buffer);
+        }
+        slot = cacheLookup(sh, sector);
+        if (slot >= 0 && sh.slots[slot].state != CACHE_READY) {
+            sh.idle.wait(guard);
+            slot = -1;
+        } else if (slot >= 0) {
+            lruUnlink(sh, slot);
+            lruPushFront(sh, slot);
+        } else if ((slot = cacheVictim(sh, guard, ok)) >= 0)
+            cacheInsert(sh, slot, sector);
+    }
+    if (!ok)
+        return false;
+    memcpy(sh.slots[slot].data, buffer, SECTOR_SIZE);
+    sh.slots[slot].dirty = true;
+    return true;
+}
+
+// forgets cached copies of sectors that were overwritten directly on the device or freed
+void CFileSystem::cacheInvalidate(uint32_t start, size_t count) {
+    for (size_t s = 0; s < CACHE_SHARDS; ++s) {
+        // the first sector of the run in shard s
+        size_t first = (s - start) & (CACHE_SHARDS - 1);
+        if (first >= count)
+            continue;
+        CacheShard &sh = m_cacheShards[s];
+        std::unique_lock<std::mutex> guard(sh.lock);
+        if (!sh.count)
+            continue;
+        // a slot being loaded or written back is dropped once its I/O is done
+        if (count / CACHE_SHARDS > sh.count) {
+            for (size_t i = 0; i < sh.count; ++i) {
+                CacheSlot &c = sh.slots[i];
+                while (c.sector != 0xFFFFFFFF && c.sector >= start && c.sector - start < count
+                       && c.state != CACHE_READY)
+                    sh.idle.wait(guard);
+                if (c.sector != 0xFFFFFFFF && c.sector >= start && c.sector - start < count)
+                    cacheDrop(sh, (int)i);
+            }
+            continue;
+        }
+        for (size_t k = first; k < count; k += CACHE_SHARDS) {
+            int slot;
+            while ((slot = cacheLookup(sh, start + k)) >= 0 && sh.slots[slot].state != CACHE_READY)
+                sh.idle.wait(guard);
+            if (slot >= 0)
+                cacheDrop(sh, slot);
+        }
+    }
+}
+
+// patches sectors just read from the device with newer, not yet written back data
+void CFileSystem::cacheOverlay(uint32_t start, void *buffer, size_t count) {
+    char *dst = static_cast<char *>(buffer);
+    for (size_t s = 0; s < CACHE_SHARDS; ++s) {
+        size_t first = (s - start) & (CACHE_SHARDS - 1);
+        if (first >= count)
+            continue;
+        CacheShard &sh = m_cacheShards[s];
+        std::lock_guard<std::mutex> guard(sh.lock);
+        if (!sh.count)
+            continue;
+        if (count / CACHE_SHARDS > sh.count) {
+            for (size_t i = 0; i < sh.count; ++i) {
+                const CacheSlot &c = sh.slots[i];
+                if (c.dirty && c.sector >= start && c.sector - start < count)
+                    memcpy(dst + (c.sector - start) * SECTOR_SIZE, c.data, SECTOR_SIZE);
+            }
+            continue;
+        }
+        for (size_t k = first; k < count; k += CACHE_SHARDS) {
+            int slot = cacheLookup(sh, start + k);
+            if (slot >= 0 && sh.slots[slot].dirty)
+                memcpy(dst + k * SECTOR_SIZE, sh.slots[slot].data, SECTOR_SIZE);
+        }
+    }
+}
+
+/* Writes dirty sectors back in ascending order, adjacent ones with a single device call: those of f's index
+ * and pointer blocks (the only sectors a file dirties in the cache), all of them for f = nullptr. The slots
+ * stay readable meanwhile, the device is written with no shard locked.
+ */
+bool CFileSystem::flushCache(const StartProgramFile *f) {
+    struct Queued {
+        uint32_t sector;
+        uint32_t shard;
+        int slot;
+    };
+    Queued *queue = nullptr;
+    size_t n = 0, cap = 0;
+    auto enqueue = [&](CacheShard &sh, std::unique_lock<std::mutex> &guard, uint32_t sector, int slot) {
+        while (slot >= 0 && sh.slots[slot].state != CACHE_READY) {
+            sh.idle.wait(guard);
+            slot = cacheLookup(sh, sector);
+        }
+        if (slot < 0 || !sh.slots[slot].dirty)
+            return;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            Queued *grown = new Queued[cap];
+            if (n)
+                memcpy(grown, queue, n * sizeof(Queued));
+            delete[] queue;
+            queue = grown;
+        }
+        sh.slots[slot].state = CACHE_WRITING;
+        queue[n++] = Queued{sector, static_cast<uint32_t>(&sh - m_cacheShards), slot};
+    };
+    for (size_t s = 0; s < CACHE_SHARDS; ++s) {
+        CacheShard &sh = m_cacheShards[s];
+        std::unique_lock<std::mutex> guard(sh.lock);
+        if (!sh.count)
+            continue;
+        if (!f) {
+            for (size_t i = 0; i < sh.count; ++i)
+                if (sh.slots[i].sector != 0xFFFFFFFF)
+                    enqueue(sh, guard, sh.slots[i].sector, (int)i);
+            continue;
+        }
+        for (size_t i = 0; i < f->ibCount + f->ptrCount; ++i) {
+            uint32_t sector = i < f->ibCount ? f->ibSectors[i] : f->ptrSectors[i - f->ibCount];
+            if ((sector & (CACHE_SHARDS - 1)) == s)
+                enqueue(sh, guard, sector, cacheLookup(sh, sector));
+        }
+    }
+    for (size_t i = 1; i < n; ++i)
+        for (size_t j = i; j > 0 && queue[j - 1].sector > queue[j].sector; --j) {
+            Queued tmp = queue[j];
+            queue[j] = queue[j - 1];
+            queue[j - 1] = tmp;
+        }
+
+    // the slots are busy: nobody changes or drops them until they are ready again
+    bool ok = true;
+    size_t written = 0;
+    char *runBuf = new char[n * SECTOR_SIZE + 1];
+    while (ok && written < n) {
+        size_t run = 1;
+        while (written + run < n && queue[written + run].sector == queue[written].sector + run)
+            run++;
+        for (size_t k = 0; k < run; ++k) {
+            const Queued &q = queue[written + k];
+            memcpy(runBuf + k * SECTOR_SIZE, m_cacheShards[q.shard].slots[q.slot].data, SECTOR_SIZE);
+        }
+        ok = checkWriteMethod(queue[written].sector, runBuf, run);
+        if (ok)
+            written += run;
+    }
+    delete[] runBuf;
+
+    for (size_t s = 0; s < CACHE_SHARDS; ++s) {
+        CacheShard &sh = m_cacheShards[s];
+        std::lock_guard<std::mutex> guard(sh.lock);
+        bool any = false;
+        for (size_t i = 0; i < n; ++i) {
+            if (queue[i].shard != s)
+                continue;
+            CacheSlot &c = sh.slots[queue[i].slot];
+            c.state = CACHE_READY;
+            // what was written before a failed run is clean
+            if (i < written) {
+                c.dirty = false;
+                sh.stats.writeBacks++;
+            }
+            any = true;
+        }
+        if (any)
+            sh.idle.notify_all();
+    }
+    delete[] queue;
+    return ok;
+}
+
+// serves file sector sectorIdx from the descriptor's read-ahead buffer, refilling it with the next
+// raWindow sectors when a sequential reader runs past its end; nullptr = read the sector directly
+const char *CFileSystem::readAheadSector(ProgramOpenFile &of, size_t sectorIdx, bool sequential) {
+    if (of.raCount && sectorIdx >= of.raStart && sectorIdx < of.raStart + of.raCount)
+        return of.raBuf + (sectorIdx - of.raStart) * SECTOR_SIZE;
+    if (!sequential) {
+        of.raWindow = 0;
+        return nullptr;
+    }
+
+    // every refill of a sequential reader doubles the window
+    of.raWindow = of.raWindow ? of.raWindow * 2 : RA_MIN_SECTORS;
+    if (of.raWindow > RA_MAX_SECTORS)
+        of.raWindow = RA_MAX_SECTORS;
+    if (!of.raBuf)
+        of.raBuf = new char[RA_MAX_SECTORS * SECTOR_SIZE];
+
+    const StartProgramFile &f = *of.fileStart;
+    size_t count = f.sectorCount - sectorIdx;
+    if (count > of.raWindow)
+        count = of.raWindow;
+
+    of.raCount = 0;
+    for (size_t done = 0; done < count;) {
+        size_t run;
+        uint32_t physSec = physicalSector(f, sectorIdx + done, run);
+        if (run > count - done)
+            run = count - done;
+        char *dst = of.raBuf + done * SECTOR_SIZE;
+        if (!checkReadMethod(physSec, dst, run))
+            return nullptr;
+        cacheOverlay(physSec, dst, run);
+        done += run;
+    }
+    of.raStart = sectorIdx;
+    of.raCount = count;
+    return of.raBuf;
+}
+
+void CFileSystem::dropReadAhead(const StartProgramFile *f) {
+    for (int i = 0; i < OPEN_FILES_MAX; i++)
+        if (f->fdMask >> i & 1)
+            openedFiles[i].raCount = 0;
+}
+
+/* Buffer slot for file sector sectorIdx; the buffer grows while writes stay sequential and is
+ * written back once it is full or the writer moves elsewhere. Sectors past the allocated end are
+ * only counted against the free space (delayed allocation): they get their place on the device
+ * when the buffer is written back, by then usually in one piece.
+ */
+char *CFileSystem::writeBufferSector(ProgramOpenFile &of, size_t sectorIdx) {
+    StartProgramFile &f = *of.fileStart;
+    if (of.wbCount && sectorIdx >= of.wbStart && sectorIdx < of.wbStart + of.wbCount)
+        return of.wbBuf + (sectorIdx - of.wbStart) * SECTOR_SIZE;
+    size_t cap = sectorIdx >= f.sectorCount ? WB_DELAYED_SECTORS : WB_SECTORS;
+    if (!of.wbCount || sectorIdx != of.wbStart + of.wbCount || of.wbCount >= cap) {
+        if (!flushWriteBuffer(of))
+            return nullptr;
+        of.wbStart = sectorIdx;
+    }
+    if (sectorIdx >= f.sectorCount) {
+        if (delaySectors(1))
+            of.wbDelayed++;
+        else {
+            // nothing left to promise: allocate now, preallocations of other files may still give way
+            if (!flushWriteBuffer(of) || !growFile(f, sectorIdx + 1))
+                return nullptr;
+            of.wbStart = sectorIdx;
+        }
+    }
+    if (!of.wbBuf)
+        of.wbBuf = new char[WB_DELAYED_SECTORS * SECTOR_SIZE];
+
+    // only sectors that already hold file data need to be read
+    char *sec = of.wbBuf + of.wbCount * SECTOR_SIZE;
+    if (sectorIdx < f.sectorCount && sectorIdx * SECTOR_SIZE < f.size) {
+        size_t run;
+        if (!cachedRead(physicalSector(f, sectorIdx, run), sec))
+            return nullptr;
+    } else
+        memset(sec, 0, SECTOR_SIZE);
+    of.wbCount++;
+    return sec;
+}
+
+bool CFileSystem::flushWriteBuffer(ProgramOpenFile &of) {
+    StartProgramFile &f = *of.fileStart;
+    bool ok = true;
+    // a full buffer belongs to a file that keeps growing, otherwise the file is most likely complete; the
+    // promised sectors are handed over with the allocation, no other writer can take them in between
+    bool grown = of.wbStart + of.wbCount <= f.sectorCount
+                 || growFile(f, of.wbStart + of.wbCount, of.wbCount == WB_DELAYED_SECTORS, &of.wbDelayed);
+    undelaySectors(of.wbDelayed);
+    of.wbDelayed = 0;
+    if (!grown) {
+        // the device or the index tree is full: what did not get sectors is lost
+        of.wbCount = f.sectorCount > of.wbStart ? f.sectorCount - of.wbStart : 0;
+        if (f.size > f.sectorCount * SECTOR_SIZE) {
+            f.size = f.sectorCount * SECTOR_SIZE;
+            markDirDirty(f);
+        }
+        ok = false;
+    }
+    for (size_t done = 0; done < of.wbCount;) {
+        size_t run;
+        uint32_t physSec = physicalSector(*of.fileStart, of.wbStart + done, run);
+        if (run > of.wbCount - done)
+            run = of.wbCount - done;
+        if (!checkWriteMethod(physSec, of.wbBuf + done * SECTOR_SIZE, run))
+            return false;
+        cacheInvalidate(physSec, run);
+        done += run;
+    }
+    of.wbCount = 0;
+    return ok;
+}
+
+bool CFileSystem::flushWriteBuffers(const StartProgramFile *f) {
+    for (int i = 0; i < OPEN_FILES_MAX; i++)
+        if ((f->fdMask >> i & 1) && !flushWriteBuffer(openedFiles[i]))
+            return false;
+    return true;
+}
+
+bool CFileSystem::hasBufferedWrites(const StartProgramFile *f) const {
+    for (int i = 0; i < OPEN_FILES_MAX; i++)
+        if ((f->fdMask >> i & 1) && openedFiles[i].wbCount)
             return true;
+    return false;
+}
+
+// buffered sectors past the first keepSectors of a truncated or deleted file never reach the device
+void CFileSystem::clipWriteBuffers(const StartProgramFile *f, size_t keepSectors) {
+    for (int i = 0; i < OPEN_FILES_MAX; i++) {
+        ProgramOpenFile &of = openedFiles[i];
+        if (!(f->fdMask >> i & 1) || of.wbStart + of.wbCount <= keepSectors)
+            continue;
+        // the delayed sectors are the last ones of the buffer
+        size_t drop = of.wbStart + of.wbCount - (keepSectors > of.wbStart ? keepSectors : of.wbStart);
+        size_t undelay = drop < of.wbDelayed ? drop : of.wbDelayed;
+        undelaySectors(undelay);
+        of.wbDelayed -= undelay;
+        of.wbCount -= drop;
+    }
+}
+
+/* A tiny file closed by its last writer moves into its directory entry: the bytes come from the write
+ * buffer (usually never written back) or from sector 0, the sector is freed and the index blocks
+ * follow on the next save. Files holding more than that one sector (reserveFile) stay where they are.
+ */
+bool CFileSystem::moveInline(ProgramOpenFile &of) {
+    StartProgramFile &f = *of.fileStart;
+    uint8_t data[INLINE_DATA_MAX] = {};
+    if (of.wbCount && of.wbStart == 0)
+        memcpy(data, of.wbBuf, f.size);
+    else {
+        char sec[SECTOR_SIZE];
+        size_t run;
+        if (!f.sectorCount || !flushWriteBuffer(of) || !cachedRead(physicalSector(f, 0, run), sec))
+            return false;
+        memcpy(data, sec, f.size);
+    }
+    dropWriteBuffers(&f);
+    trimExtents(f, 0);
+    memcpy(f.inlineData, data, sizeof(data));
+    f.inlined = true;
+    markDirDirty(f);
+    return true;
+}
+
+// the first write turns an inline file into a regular one; its bytes become a delayed sector in the write buffer
+bool CFileSystem::moveOutOfInline(ProgramOpenFile &of) {
+    StartProgramFile &f = *of.fileStart;
+    if (!f.inlined)
+        return true;
+    f.inlined = false;
+    markDirDirty(f);
+    if (!f.size)
+        return true;
+    char *sec = writeBufferSector(of, 0);
+    if (!sec) {
+        f.inlined = true;
+        return false;
+    }
+    memcpy(sec, f.inlineData, f.size);
+    return true;
+}
+
+bool CFileSystem::resizeCache(size_t sectors) {
+    if (!flushCache())
+        return false;
+    for (size_t s = 0; s < CACHE_SHARDS; ++s) {
+        CacheShard &sh = m_cacheShards[s];
+        std::unique_lock<std::mutex> guard(sh.lock);
+        // sectors dirtied since the flush are written back with the shard locked
+        for (size_t i = 0; i < sh.count; ++i) {
+            CacheSlot &c = sh.slots[i];
+            while (c.state != CACHE_READY)
+                sh.idle.wait(guard);
+            if (c.dirty && !checkWriteMethod(c.sector, c.data))
+                return false;
         }
+        delete[] sh.slots;
+        delete[] sh.buckets;
+        sh.slots = nullptr;
+        sh.buckets = nullptr;
+        sh.count = sectors / CACHE_SHARDS + (s < sectors % CACHE_SHARDS);
+        sh.lruHead = sh.lruTail = -1;
+        if (!sh.count)
+            continue;
+
+        size_t buckets = 16;
+        while (buckets < 2 * sh.count)
+            buckets *= 2;
+        sh.bucketMask = buckets - 1;
+        sh.buckets = new int[buckets];
+        for (size_t i = 0; i < buckets; ++i)
+            sh.buckets[i] = -1;
+        sh.slots = new CacheSlot[sh.count];
+        for (size_t i = 0; i < sh.count; ++i) {
+            sh.slots[i].sector = 0xFFFFFFFF;
+            sh.slots[i].dirty = false;
+            sh.slots[i].state = CACHE_READY;
+            sh.slots[i].hashNext = -1;
+            sh.slots[i].prev = sh.slots[i].next = -1;
+            lruPushFront(sh, (int)i);
+        }
+    }
+    return true;
+}
+
+// index block b of a file: 0 = root, 1 = single-indirect, 2.. = leaves of the deeper trees
+static size_t indexBlockOf(size_t extentIdx) {
+    if (extentIdx < ROOT_EXTENTS)
+        return 0;
+    if (extentIdx < ROOT_EXTENTS + EXTENTS_PER_BLOCK)
+        return 1;
+    return 2 + (extentIdx - ROOT_EXTENTS - EXTENTS_PER_BLOCK) / EXTENTS_PER_BLOCK;
+}
+
+static size_t indexBlockFirst(size_t b) {
+    return b == 0 ? 0 : ROOT_EXTENTS + (b - 1) * EXTENTS_PER_BLOCK;
+}
+
+// children of the pointer block `level` levels above the leaves that starts at leaf firstLeaf
+static size_t pointerChildren(int level, size_t firstLeaf, size_t leaves) {
+    size_t span = leavesUnder(level - 1);
+    size_t count = (leaves - firstLeaf + span - 1) / span;
+    return count < POINTERS_PER_BLOCK ? count : POINTERS_PER_BLOCK;
+}
+
+// pointer blocks the trees need for `leaves` extent blocks; tree t holds leavesUnder(t + 1) of them
+static size_t pointerBlocksFor(size_t leaves) {
+    size_t total = 0;
+    for (int t = 0; t < INDIRECT_TREES && leaves; ++t) {
+        size_t n = leaves < leavesUnder(t + 1) ? leaves : leavesUnder(t + 1);
+        for (int level = 1; level <= t + 1; ++level)
+            total += (n + leavesUnder(level) - 1) / leavesUnder(level);
+        leaves -= n;
+    }
+    return total;
+}
+
+// releases the index blocks past the first `keep` ones and the pointer blocks no longer needed above them;
+// the pointer blocks are kept in pre-order, so the ones a smaller tree needs come first
+void CFileSystem::freeIndexBlocks(StartProgramFile &f, size_t keep) {
+    std::lock_guard<std::mutex> guard(m_allocMutex);
+    for (size_t i = keep; i < f.ibCount; ++i) {
+        markRange(f.ibSectors[i], 1, false);
+        cacheInvalidate(f.ibSectors[i], 1);
+    }
+    if (f.ibCount > keep)
+        f.ibCount = keep;
+    size_t keepPtr = pointerBlocksFor(keep > 2 ? keep - 2 : 0);
+    for (size_t i = keepPtr; i < f.ptrCount; ++i) {
+        markRange(f.ptrSectors[i], 1, false);
+        cacheInvalidate(f.ptrSectors[i], 1);
+    }
+    if (f.ptrCount > keepPtr)
+        f.ptrCount = keepPtr;
+}
+
+/* Writes the pointer block f.ptrSectors[idx] (`level` levels above the leaves, first leaf firstLeaf) and the
+ * pointer blocks below it in pre-order, advancing idx past them. Only blocks whose list of children changed
+ * when the leaf count moved from/to changedFrom are rewritten.
+ */
+bool CFileSystem::savePointerBlock(StartProgramFile &f, size_t &idx, int level, size_t firstLeaf, size_t leaves,
+                                   size_t changedFrom) {
+    size_t self = idx++;
+    size_t span = leavesUnder(level - 1), count = pointerChildren(level, firstLeaf, leaves);
+    char ptrBuf[SECTOR_SIZE];
+    memset(ptrBuf, 0xFF, SECTOR_SIZE);
+    auto &pb = *reinterpret_cast<PointerBlock *>(ptrBuf);
+    for (size_t k = 0; k < count; ++k) {
+        if (level == 1) {
+            pb.blocks[k] = f.ibSectors[2 + firstLeaf + k];
+            continue;
+        }
+        pb.blocks[k] = f.ptrSectors[idx];
+        if (!savePointerBlock(f, idx, level - 1, firstLeaf + k * span, leaves, changedFrom))
+            return false;
+    }
+    if (changedFrom >= firstLeaf + leavesUnder(level))
+        return true;
+    return cachedWrite(f.ptrSectors[self], ptrBuf);
+}
+
+// brings the file's index tree up to date: blocks are kept in place, only the root and the blocks
+// holding changed extents are rewritten, missing ones are appended, surplus ones freed
+bool CFileSystem::saveIndexBlocks(StartProgramFile &f) {
+    size_t need = f.extentCount ? indexBlockOf(f.extentCount - 1) + 1 : 0;
+    if (f.dirtyExtent == SIZE_MAX && need == f.ibCount)
+        return true;
+
+    size_t first = f.dirtyExtent == SIZE_MAX ? need : indexBlockOf(f.dirtyExtent);
+    size_t oldLeaves = f.ibCount > 2 ? f.ibCount - 2 : 0, leaves = need > 2 ? need - 2 : 0;
+    freeIndexBlocks(f, need);
+    while (f.ibCount < need) {
+        uint32_t ibSec;
+        if (!findAllocFreeSec(ibSec))
+            return false;
+        pushIndexBlock(f, ibSec);
+    }
+    while (f.ptrCount < pointerBlocksFor(leaves)) {
+        uint32_t ptrSec;
+        if (!findAllocFreeSec(ptrSec))
+            return false;
+        pushPointerBlock(f, ptrSec);
+    }
+
+    // pointer blocks change only with the number of leaves: those covering the leaves added or removed
+    uint32_t tops[INDIRECT_TREES];
+    size_t idx = 0, firstLeaf = 0;
+    for (int t = 0; t < INDIRECT_TREES; firstLeaf += leavesUnder(t + 1), ++t) {
+        tops[t] = 0xFFFFFFFF;
+        if (firstLeaf >= leaves)
+            continue;
+        tops[t] = f.ptrSectors[idx];
+        size_t changedFrom = oldLeaves != leaves ? (oldLeaves < leaves ? oldLeaves : leaves) : SIZE_MAX;
+        if (!savePointerBlock(f, idx, t + 1, firstLeaf, leaves, changedFrom))
+            return false;
+    }
+
+    for (size_t b = first > 1 ? first : 1; b < need; ++b) {
+        char ibBuf[SECTOR_SIZE]{};
+        auto &ib = *reinterpret_cast<ExtentBlock *>(ibBuf);
+        size_t from = indexBlockFirst(b);
+        size_t fill = f.extentCount - from < EXTENTS_PER_BLOCK ? f.extentCount - from : EXTENTS_PER_BLOCK;
+        memcpy(ib.extents, f.extents + from, fill * sizeof(FileExtent));
+        ib.extentCount = static_cast<uint32_t>(fill);
+        if (!cachedWrite(f.ibSectors[b], ibBuf))
+            return false;
+    }
+
+    // the root carries the extent count and the indirect pointers, it changes with everything else
+    if (need) {
+        char rootBuf[SECTOR_SIZE]{};
+        auto &root = *reinterpret_cast<IndexRoot *>(rootBuf);
+        root.extentCount = static_cast<uint32_t>(f.extentCount);
+        root.indirect = need > 1 ? f.ibSectors[1] : 0xFFFFFFFF;
+        root.doubleIndirect = tops[0];
+        root.tripleIndirect = tops[1];
+        root.quadIndirect = tops[2];
+        size_t fill = f.extentCount < ROOT_EXTENTS ? f.extentCount : ROOT_EXTENTS;
+        memcpy(root.extents, f.extents, fill * sizeof(FileExtent));
+        if (!cachedWrite(f.ibSectors[0], rootBuf))
+            return false;
+    }
+
+    uint32_t rootSec = need ? f.ibSectors[0] : 0xFFFFFFFF;
+    if (rootSec != f.rootIB) {
+        f.rootIB = rootSec;
+        markDirDirty(f);
     }
-    return false;
+    f.dirtyExtent = SIZE_MAX;
+    return true;
 }
 
-
-void CFileSystem::freeIBChain(uint32_t ibSec) {
-    while (ibSec != 0xFFFFFFFF) {
-        if (ibSec < fSectorBitSize)
-            fSectorBit[ibSec] = false;
-
-        char buf[SECTOR_SIZE];
-        if (m_dev.m_Read(ibSec, buf, 1) != 1) break;
-        ibSec = reinterpret_cast<fileBlockID *>(buf)->nextBlock;
+void CFileSystem::buildDirSector(int sec, char *buf) const {
+    memset(buf, 0, SECTOR_SIZE);
+    InputFileDir *d = reinterpret_cast<InputFileDir *>( buf );
+    for (size_t rec = 0, fi = (size_t)sec * REC_PER_SEC; rec < REC_PER_SEC && fi < m_dirEntries; ++rec, ++fi) {
+        InputFileDir &de = d[rec];
+        de.mainIndBlock = 0xFFFFFFFF;
+        if (!files[fi].usedFlag)
+            continue;
+        strncpy(de.name, files[fi].name, FILENAME_LEN_MAX);
+        de.name[FILENAME_LEN_MAX] = '\0';
+        de.size = files[fi].size > 0xFFFFFFFFu ? 0xFFFFFFFFu : static_cast<uint32_t>( files[fi].size );
+        de.usedFlag = 1;
+        de.mainIndBlock = files[fi].rootIB;
+        if (files[fi].inlined && files[fi].size) {
+            de.inlineFlag = 1;
+            memcpy(de.inlineData, files[fi].inlineData, files[fi].size);
+        }
     }
 }
 
 CFileSystem::CFileSystem(const TBlkDev &dev)
-        : m_dev(dev), fSectorBit(nullptr), fSectorBitSize(dev.m_Sectors), findfPosition(0), m_nextFree(0) {
-    fSectorBit = new bool[fSectorBitSize];
-
-    memset(fSectorBit, 0, fSectorBitSize * sizeof(bool));
-
-    for (int i = 0; i < DIR_ENTRIES_MAX; i++)
-        files[i] = StartProgramFile{};
-
+        : m_dev(dev), fSectorBit(nullptr), fFullWords(nullptr), fSectorBitSize(dev.m_Sectors),
+          fBitWords(bitmapSectors(dev.m_Sectors) * (SECTOR_SIZE / sizeof(uint64_t))),
+          m_freeSectors(fBitWords * 64), m_delayedSectors(0), findfPosition(0),
+          m_nextFree(0), m_headDirty(true), m_bmDirty(nullptr),
+          m_image(nullptr), m_asyncInFlight(0) {
+    resizeCache(CACHE_SECTORS_DEFAULT);
+
+    m_dirSectors = dirSectorsFor(dev.m_Sectors);
+    m_dirEntries = m_dirSectors * REC_PER_SEC;
+    files = new StartProgramFile[m_dirEntries];
+    size_t buckets = 16;
+    while (buckets < 2 * m_dirEntries)
+        buckets *= 2;
+    m_nameIndexMask = buckets - 1;
+    m_nameIndex = new int[buckets];
+    m_freeSlots = new int[m_dirEntries];
+    rebuildDirIndex();
+
+    // a fresh file system has nothing on disk yet: everything is dirty until loadFile says otherwise
+    m_dirDirty = new std::atomic<uint8_t>[m_dirSectors];
+    for (size_t i = 0; i < m_dirSectors; i++)
+        m_dirDirty[i].store(1);
+    m_bmDirty = new uint8_t[bitmapSectors(fSectorBitSize)];
+    memset(m_bmDirty, 1, bitmapSectors(fSectorBitSize));
+
+    // whole bitmap sectors, so the bitmap can be written/read with one device call
+    fSectorBit = new uint64_t[fBitWords];
+    fFullWords = new uint64_t[(fBitWords + 63) / 64];
+    memset(fSectorBit, 0, fBitWords * sizeof(uint64_t));
+    memset(fFullWords, 0, (fBitWords + 63) / 64 * sizeof(uint64_t));
+    if (fSectorBitSize)
+        addRun(0, fSectorBitSize);
+    markRange(fSectorBitSize, fBitWords * 64 - fSectorBitSize, true);
 
     for (int i = 0; i < OPEN_FILES_MAX; i++)
-        openedFiles[i] = ProgramOpenFile{nullptr, 0, false, false};
+        openedFiles[i] = ProgramOpenFile{nullptr, 0, false, false, false, false, nullptr, 0, 0, 0, 0, nullptr, 0, 0, 0};
 }
 
 CFileSystem::~CFileSystem() {
+    waitAsync();
     delete[] fSectorBit;
+    delete[] fFullWords;
+    for (CacheShard &sh : m_cacheShards) {
+        delete[] sh.slots;
+        delete[] sh.buckets;
+    }
+    delete[] m_bmDirty;
+    delete[] m_dirDirty;
+    delete[] files;
+    delete[] m_nameIndex;
+    delete[] m_freeSlots;
+    for (int i = 0; i < OPEN_FILES_MAX; i++) {
+        delete[] openedFiles[i].raBuf;
+        delete[] openedFiles[i].wbBuf;
+    }
 }
 
 
@@ -267,12 +1991,9 @@ bool CFileSystem::createFs(const TBlkDev &dev) {
 
     CFileSystem fs(dev);
 
-    const uint32_t REC_PER_SEC = SECTOR_SIZE / sizeof ( InputFileDir );
-    const uint32_t direcSec    = (DIR_ENTRIES_MAX + REC_PER_SEC - 1) / REC_PER_SEC;
-    const uint32_t bmSec = (dev.m_Sectors + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    const uint32_t bmSec = bitmapSectors(dev.m_Sectors);
 
-    for (uint32_t i = 0; i < 1 + direcSec + bmSec; ++i)
-        fs.fSectorBit[i] = true;
+    fs.markRange(0, 1 + fs.m_dirSectors + bmSec, true);
 
     return fs.saveFile();
 }
@@ -292,59 +2013,78 @@ CFileSystem *CFileSystem::mount(const TBlkDev &dev) {
 
 //---------------------------------------------------------------------------
 bool CFileSystem::umount() {
+    waitAsync();
     for (int i = 0; i < OPEN_FILES_MAX; i++) {
         if (openedFiles[i].openFLag)
             closeFile(i);
     }
+    std::lock_guard<std::mutex> guard(m_dirMutex);
     bool tmpCheck = saveFile();
     return tmpCheck;
 }
 
 //---------------------------------------------------------------------------
 size_t CFileSystem::fileSize(const char *fileName) {
+    std::lock_guard<std::mutex> guard(m_dirMutex);
     int idx = findFileID(fileName);
     if (idx < 0)
         return SIZE_MAX;
+    std::shared_lock<std::shared_mutex> fileGuard(files[idx].lock);
     return (files[idx].size == static_cast<size_t>( SIZE_MAX )) ? SIZE_MAX : files[idx].size;
 }
 
 
 //---------------------------------------------------------------------------
 int CFileSystem::openFile(const char *fileName, bool writeMode) {
+    return openFile(fileName, writeMode ? FS_OPEN_TRUNCATE : FS_OPEN_READ);
+}
+
+int CFileSystem::openFile(const char *fileName, FsOpenMode mode) {
+    std::lock_guard<std::mutex> guard(m_dirMutex);
     int idx = findFileID(fileName);
-    if (!writeMode && idx < 0)
+    bool create = mode == FS_OPEN_TRUNCATE || mode == FS_OPEN_APPEND;
+    if (!create && idx < 0)
         return -1;
+    if (idx >= 0) {
+        std::lock_guard<std::shared_mutex> fileGuard(files[idx].lock);
+        if (!ensureMapLoaded(files[idx]))
+            return -1;
+    }
 
-    if (writeMode && idx < 0) {
+    if (create && idx < 0) {
         idx = firstFreePosInput();
         if (idx < 0) return -1;
 
         files[idx].usedFlag = true;
         files[idx].size = 0;
         files[idx].sectorCount = 0;
-        files[idx].rootIB = 0xFFFFFFFF;
         memset(files[idx].name, 0, sizeof files[idx].name);
         strncpy(files[idx].name, fileName, FILENAME_LEN_MAX);
+        indexInsert(idx);
+        markDirDirty(files[idx]);
     }
 
-    if (writeMode && idx >= 0) {
-        for (size_t i = 0; i < files[idx].sectorCount; ++i)
-            fSectorBit[files[idx].sectorsArray[i]] = false;
-
-        freeIBChain(files[idx].rootIB);
-        files[idx].rootIB = 0xFFFFFFFF;
+    std::lock_guard<std::shared_mutex> fileGuard(files[idx].lock);
+    if (mode == FS_OPEN_TRUNCATE) {
+        dropReadAhead(&files[idx]);
+        dropWriteBuffers(&files[idx]);
+        freeExtents(files[idx]);
 
+        // the extent blocks stay allocated, saveFile reuses them in place
         files[idx].size = 0;
-        files[idx].sectorCount = 0;
-        memset(files[idx].sectorsArray, 0,
-               files[idx].allocatedSectors * sizeof(size_t));
+        files[idx].inlined = false;
+        markDirDirty(files[idx]);
     }
 
     int fd = firstFreeOpenFile();
     if (fd < 0)
         return -1;
 
-    openedFiles[fd] = {&files[idx], 0, writeMode, true};
+    char *raBuf = openedFiles[fd].raBuf, *wbBuf = openedFiles[fd].wbBuf;
+    bool append = mode == FS_OPEN_APPEND;
+    openedFiles[fd] = {&files[idx], append ? files[idx].size : 0, mode != FS_OPEN_READ, append, false, true,
+                       raBuf, 0, 0, 0, 0, wbBuf, 0, 0, 0};
+    files[idx].fdMask |= 1u << fd;
     return fd;
 }
 
@@ -354,12 +2094,35 @@ bool CFileSystem::closeFile(int fd) {
     if (fd < 0 || fd >= OPEN_FILES_MAX || !openedFiles[fd].openFLag)
         return false;
 
-    StartProgramFile &spf = *openedFiles[fd].fileStart;
-    if (openedFiles[fd].tmpPos > spf.size)
-        spf.size = openedFiles[fd].tmpPos;
-
-    openedFiles[fd].openFLag = false;
-    return true;
+    // writeFile keeps the size current; the position may lie past the end after seekFile
+    StartProgramFile &f = *openedFiles[fd].fileStart;
+    bool ok = true, freeSlot;
+    {
+        std::lock_guard<std::shared_mutex> fileGuard(f.lock);
+        // only data this descriptor changed, in a file without sectors reserved beyond it, moves inline
+        if (f.fdMask == 1u << fd && openedFiles[fd].modifiedFlag && !f.inlined && f.size && f.size <= INLINE_DATA_MAX
+            && f.sectorCount <= 1)
+            ok = moveInline(openedFiles[fd]);
+        ok = flushWriteBuffer(openedFiles[fd]) && ok;
+        // only this file's dirty index blocks, the rest of the cache waits for umount
+        ok = flushCache(&f) && ok;
+        f.fdMask &= ~(1u << fd);
+        if (!f.fdMask) {
+            std::lock_guard<std::mutex> guard(m_allocMutex);
+            releaseReservation(f);
+        }
+        // the file was deleted while open (deleteFile) and this was its last descriptor
+        freeSlot = !f.fdMask && !f.usedFlag;
+    }
+    {
+        std::lock_guard<std::mutex> guard(m_dirMutex);
+        openedFiles[fd].openFLag = false;
+        if (freeSlot) {
+            f = StartProgramFile{};
+            m_freeSlots[m_freeCount++] = static_cast<int>(&f - files);
+        }
+    }
+    return ok;
 }
 
 //---------------------------------------------------------------------------
@@ -369,79 +2132,170 @@ size_t CFileSystem::readFile(int fd, void *data, size_t len) {
     auto &tmpOpenFile = openedFiles[fd];
     if (!tmpOpenFile.openFLag)
         return 0;
-    if (tmpOpenFile.writeFlag) {
-//        std::cout<< "debugprint" << std::endl;
-    }
     StartProgramFile &tmpSPF = *tmpOpenFile.fileStart;
-    if (tmpOpenFile.tmpPos >= tmpSPF.size)
+    std::shared_lock<std::shared_mutex> fileGuard(tmpSPF.lock, std::defer_lock);
+    if (!lockForRead(tmpSPF, fileGuard))
+        return 0;
+    size_t done = readLocked(tmpSPF, &tmpOpenFile, static_cast<uint8_t *>(data), len, tmpOpenFile.tmpPos);
+    tmpOpenFile.tmpPos += done;
+    tmpOpenFile.raNext = tmpOpenFile.tmpPos;
+    return done;
+}
+
+// takes f's lock shared; data buffered by a writer must reach the device first, which needs the exclusive lock
+bool CFileSystem::lockForRead(StartProgramFile &f, std::shared_lock<std::shared_mutex> &fileGuard) {
+    fileGuard.lock();
+    if (hasBufferedWrites(&f)) {
+        fileGuard.unlock();
+        {
+            std::lock_guard<std::shared_mutex> writeGuard(f.lock);
+            if (!flushWriteBuffers(&f))
+                return false;
+        }
+        fileGuard.lock();
+    }
+    return true;
+}
+
+/* Reads file bytes from pos on with f's lock held shared. Partial sectors come from the read-ahead buffer of
+ * ra (nullptr = through the sector cache); nothing of the descriptor but its read-ahead buffer changes.
+ */
+size_t CFileSystem::readLocked(StartProgramFile &f, ProgramOpenFile *ra, uint8_t *dst, size_t len, size_t pos) {
+    if (pos >= f.size)
         return 0;
-    size_t needToRead = tmpSPF.size - tmpOpenFile.tmpPos;
+    size_t needToRead = f.size - pos;
     if (needToRead > len)
         needToRead = len;
+    if (f.inlined) {
+        memcpy(dst, f.inlineData + pos, needToRead);
+        return needToRead;
+    }
+    bool sequential = ra && pos == ra->raNext;
 
     size_t tmpToTRead = 0;
-    uint8_t *tmpDest = (uint8_t *) data;
-
     while (needToRead > 0) {
-        uint32_t sectorIdx = (uint32_t) (tmpOpenFile.tmpPos / SECTOR_SIZE);
-        if (sectorIdx >= tmpSPF.sectorCount)
+        uint32_t sectorIdx = (uint32_t) (pos / SECTOR_SIZE);
+        if (sectorIdx >= f.sectorCount)
             break;
-        uint32_t offset = (uint32_t) (tmpOpenFile.tmpPos % SECTOR_SIZE);
+        uint32_t offset = (uint32_t) (pos % SECTOR_SIZE);
+
+        size_t run;
+        uint32_t physSec = physicalSector(f, sectorIdx, run);
+
+        if (offset == 0 && needToRead >= SECTOR_SIZE) {
+            // whole sectors go straight to the caller, one device call per contiguous run
+            if (run > needToRead / SECTOR_SIZE)
+                run = needToRead / SECTOR_SIZE;
+            if (!checkReadMethod(physSec, dst, run))
+                break;
+            cacheOverlay(physSec, dst, run);
+            size_t bytes = run * SECTOR_SIZE;
+            dst = dst + bytes;
+            pos = pos + bytes;
+            tmpToTRead = tmpToTRead + bytes;
+            needToRead = needToRead - bytes;
+            continue;
+        }
 
         char sectorBuf[SECTOR_SIZE];
-        if (!checkReadMethod(tmpSPF.sectorsArray[sectorIdx], sectorBuf))
-            break;
+        const char *secData = ra ? readAheadSector(*ra, sectorIdx, sequential) : nullptr;
+        if (!secData) {
+            if (!cachedRead(physSec, sectorBuf))
+                break;
+            secData = sectorBuf;
+        }
         size_t tmpCouldRead = SECTOR_SIZE - offset;
         if (tmpCouldRead > needToRead) tmpCouldRead = needToRead;
 
-        memcpy(tmpDest, sectorBuf + offset, tmpCouldRead);
+        memcpy(dst, secData + offset, tmpCouldRead);
 
-        tmpDest = tmpDest + tmpCouldRead;
-        tmpOpenFile.tmpPos = tmpOpenFile.tmpPos + tmpCouldRead;
+        dst = dst + tmpCouldRead;
+        pos = pos + tmpCouldRead;
         tmpToTRead = tmpToTRead + tmpCouldRead;
         needToRead = needToRead - tmpCouldRead;
     }
-
     return tmpToTRead;
 }
 
 
 //---------------------------------------------------------------------------
 size_t CFileSystem::writeFile(int fd, const void *data, size_t len) {
-    if (fd < 0 || fd >= OPEN_FILES_MAX)
+    if (fd < 0 || fd >= OPEN_FILES_MAX || !openedFiles[fd].openFLag)
         return 0;
     auto &tmpOpenFile = openedFiles[fd];
-    if (!tmpOpenFile.openFLag || !tmpOpenFile.writeFlag)
-        return 0;
+    std::lock_guard<std::shared_mutex> fileGuard(tmpOpenFile.fileStart->lock);
+    if (tmpOpenFile.appendFlag)
+        tmpOpenFile.tmpPos = tmpOpenFile.fileStart->size;
+    size_t done = writeLocked(fd, data, len, tmpOpenFile.tmpPos);
+    tmpOpenFile.tmpPos += done;
+    return done;
+}
 
+/* Writes len bytes at file offset pos through fd's write buffer, with the file lock held exclusively; a gap
+ * past the end is filled with zeros first. Returns the bytes of data written, the position of fd stays.
+ */
+size_t CFileSystem::writeLocked(int fd, const void *data, size_t len, size_t pos) {
+    auto &tmpOpenFile = openedFiles[fd];
     StartProgramFile &tmpSPF = *tmpOpenFile.fileStart;
+    // a file deleted while open takes no more data
+    if (!tmpOpenFile.writeFlag || !tmpSPF.usedFlag)
+        return 0;
+
     size_t totalBitWritten = 0;
+    dropReadAhead(&tmpSPF);
+    if (!moveOutOfInline(tmpOpenFile))
+        return 0;
+    tmpOpenFile.modifiedFlag = true;
+
+    // appends other descriptors still buffer have no sectors yet, they get them before this write lands
+    for (int i = 0; i < OPEN_FILES_MAX; i++)
+        if (i != fd && (tmpSPF.fdMask >> i & 1) && openedFiles[i].wbDelayed && !flushWriteBuffer(openedFiles[i]))
+            return 0;
     const uint8_t *src = static_cast<const uint8_t *>(data);
 
-    while (len > 0) {
-        uint32_t sectorIndex = static_cast<uint32_t>(tmpOpenFile.tmpPos / SECTOR_SIZE);
-        uint32_t offset = static_cast<uint32_t>(tmpOpenFile.tmpPos % SECTOR_SIZE);
+    // a write past the end of the file (after seekFile) fills the gap with zeros first
+    while (pos > tmpSPF.size) {
+        static const uint8_t zeros[8 * SECTOR_SIZE] = {};
+        size_t at = tmpSPF.size;
+        size_t chunk = pos - at < sizeof(zeros) ? pos - at : sizeof(zeros);
+        if (writeLocked(fd, zeros, chunk, at) != chunk)
+            return 0;
+    }
 
-        if (sectorIndex >= tmpSPF.sectorCount) {
-            uint32_t newSec;
-            if (!findAllocFreeSec(newSec))
-                break;
+    // an append smaller than the delayed buffer waits there for its sectors, a larger one knows its size now
+    size_t needSectors = (pos + len + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    if (needSectors > tmpSPF.sectorCount && len >= WB_DELAYED_SECTORS * SECTOR_SIZE) {
+        // the buffered appends in front of it are the first to get sectors, in the same run, using up their promise
+        growFile(tmpSPF, needSectors, true, &tmpOpenFile.wbDelayed);
+        if (tmpSPF.sectorCount * SECTOR_SIZE < pos + len)
+            len = tmpSPF.sectorCount * SECTOR_SIZE > pos ? tmpSPF.sectorCount * SECTOR_SIZE - pos : 0;
+    }
 
-            secArrSearchSpace(tmpSPF, 1);
-            tmpSPF.sectorsArray[tmpSPF.sectorCount++] = newSec;
+    while (len > 0) {
+        uint32_t sectorIndex = static_cast<uint32_t>(pos / SECTOR_SIZE);
+        uint32_t offset = static_cast<uint32_t>(pos % SECTOR_SIZE);
+
+        if (offset == 0 && len >= SECTOR_SIZE && sectorIndex < tmpSPF.sectorCount) {
+            // whole sectors are written from the caller's buffer, one device call per contiguous run
+            size_t run;
+            uint32_t physSec = physicalSector(tmpSPF, sectorIndex, run);
+            if (run > len / SECTOR_SIZE)
+                run = len / SECTOR_SIZE;
+            if (!flushWriteBuffer(tmpOpenFile) || !checkWriteMethod(physSec, src, run))
+                break;
+            cacheInvalidate(physSec, run);
+            size_t bytes = run * SECTOR_SIZE;
+            src = src + bytes;
+            len = len - bytes;
+            totalBitWritten = totalBitWritten + bytes;
+            pos = pos + bytes;
             continue;
         }
-        uint32_t physSec = static_cast<uint32_t>(tmpSPF.sectorsArray[sectorIndex]);
 
-        bool splitSpaceFlag = (offset != 0 || (offset + len < SECTOR_SIZE));
-
-        char sectorBuf[SECTOR_SIZE];
-        if (splitSpaceFlag) {
-            if (!checkReadMethod(physSec, sectorBuf))
-                break;
-        } else {
-            memset(sectorBuf, 0, SECTOR_SIZE);
-        }
+        // partial head/tail sector or an append: patched in the descriptor's write buffer
+        char *sectorBuf = writeBufferSector(tmpOpenFile, sectorIndex);
+        if (!sectorBuf)
+            break;
 
         size_t canWrite = SECTOR_SIZE - offset;
         if (canWrite > len)
@@ -449,50 +2303,444 @@ size_t CFileSystem::writeFile(int fd, const void *data, size_t len) {
 
         memcpy(sectorBuf + offset, src, canWrite);
 
-        if (!checkWriteMethod(physSec, sectorBuf))
-            break;
-
         src = src + canWrite;
         len = len - canWrite;
         totalBitWritten = totalBitWritten + canWrite;
-        tmpOpenFile.tmpPos = tmpOpenFile.tmpPos + canWrite;
+        pos = pos + canWrite;
     }
 
-    if (tmpOpenFile.tmpPos > tmpSPF.size)
-        tmpSPF.size = tmpOpenFile.tmpPos;
+    if (pos > tmpSPF.size) {
+        tmpSPF.size = pos;
+        markDirDirty(tmpSPF);
+    }
 
     return totalBitWritten;
 }
 
+/* Allocates sectors until the file has needSectors of them; false if the device or the index tree is full.
+ * A speculative allocation also preallocates a window that grows with the file (see allocFor); delayed is
+ * the promise of the buffered appends the new sectors are for, what it does not use up is left in it.
+ */
+bool CFileSystem::growFile(StartProgramFile &f, size_t needSectors, bool speculative, size_t *delayed) {
+    while (f.sectorCount < needSectors) {
+        uint32_t hint = 0xFFFFFFFF, runStart, runLen;
+        if (f.extentCount > 0)
+            hint = f.extents[f.extentCount - 1].start + f.extents[f.extentCount - 1].length;
+        size_t extra = 0;
+        if (speculative)
+            extra = f.sectorCount < PREALLOC_MIN_SECTORS ? PREALLOC_MIN_SECTORS
+                    : f.sectorCount > PREALLOC_MAX_SECTORS ? PREALLOC_MAX_SECTORS : f.sectorCount;
+        if (!allocFor(f, needSectors - f.sectorCount, extra, runStart, runLen, delayed))
+            return false;
+        if (f.extentCount >= MAX_FILE_EXTENTS && runStart != hint) {
+            // the index tree is full, only a run continuing the last extent still fits
+            std::lock_guard<std::mutex> guard(m_allocMutex);
+            markRange(runStart, runLen, false);
+            releaseReservation(f);
+            return false;
+        }
+        appendExtent(f, runStart, runLen);
+    }
+    return true;
+}
+
+bool CFileSystem::reserveFile(int fd, size_t bytes) {
+    if (fd < 0 || fd >= OPEN_FILES_MAX || !openedFiles[fd].openFLag || !openedFiles[fd].writeFlag
+        || bytes >= DEVICE_SIZE_MAX)
+        return false;
+    StartProgramFile &tmpSPF = *openedFiles[fd].fileStart;
+    std::lock_guard<std::shared_mutex> fileGuard(tmpSPF.lock);
+    if (!tmpSPF.usedFlag)
+        return false;
+    size_t needSectors = (bytes + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    if (needSectors <= tmpSPF.sectorCount || !moveOutOfInline(openedFiles[fd]))
+        return needSectors <= tmpSPF.sectorCount;
+    {
+        // the explicit reservation replaces the speculative one
+        std::lock_guard<std::mutex> guard(m_allocMutex);
+        releaseReservation(tmpSPF);
+    }
+    return growFile(tmpSPF, needSectors, false);
+}
+
+//---------------------------------------------------------------------------
+void CFileSystem::attachAsyncDevice(const TAsyncBlkDev &dev) {
+    waitAsync();
+    m_asyncDev = dev;
+}
+
+void CFileSystem::waitAsync() {
+    std::unique_lock<std::mutex> guard(m_asyncMutex);
+    m_asyncCond.wait(guard, [this] { return m_asyncInFlight == 0; });
+}
+
+/* The op starts with one reference held by its submitter, dropped by completeAsync once all runs are queued.
+ * The submitter drops it only after releasing the file lock: done may run right there (every run already
+ * finished) and is free to call back into the filesystem.
+ */
+CFileSystem::AsyncOp *CFileSystem::beginAsync(size_t bytes, std::function<void(size_t)> done) {
+    {
+        std::lock_guard<std::mutex> guard(m_asyncMutex);
+        m_asyncInFlight++;
+    }
+    AsyncOp *op = new AsyncOp;
+    op->pending.store(1);
+    op->failedAt.store(SIZE_MAX);
+    op->bytes = bytes;
+    op->done = std::move(done);
+    return op;
+}
+
+void CFileSystem::asyncFailed(AsyncOp *op, size_t offset) {
+    size_t cur = op->failedAt.load();
+    while (offset < cur && !op->failedAt.compare_exchange_weak(cur, offset)) {
+    }
+}
+
+void CFileSystem::completeAsync(AsyncOp *op) {
+    if (op->pending.fetch_sub(1) != 1)
+        return;
+    size_t failedAt = op->failedAt.load();
+    op->done(failedAt < op->bytes ? failedAt : op->bytes);
+    delete op;
+
+    std::lock_guard<std::mutex> guard(m_asyncMutex);
+    if (--m_asyncInFlight == 0)
+        m_asyncCond.notify_all();
+}
+
+/* Queues file bytes [pos, pos + bytes) (whole sectors, pos aligned) as one batch, one request per contiguous
+ * physical run. buf holds the data of byte pos, failures are reported relative to it.
+ */
+bool CFileSystem::queueRuns(AsyncOp *op, StartProgramFile &f, bool write, uint8_t *buf, size_t pos, size_t bytes) {
+    size_t count = 0;
+    for (size_t off = 0; off < bytes; count++) {
+        size_t run;
+        physicalSector(f, (pos + off) / SECTOR_SIZE, run);
+        off += run * SECTOR_SIZE < bytes - off ? run * SECTOR_SIZE : bytes - off;
+    }
+    if (!count)
+        return true;
+
+    TIoRequest *reqs = new TIoRequest[count];
+    size_t off = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t run;
+        uint32_t phys = physicalSector(f, (pos + off) / SECTOR_SIZE, run);
+        if (run > (bytes - off) / SECTOR_SIZE)
+            run = (bytes - off) / SECTOR_SIZE;
+        if (write)
+            cacheInvalidate(phys, run);
+        reqs[i].m_Write = write;
+        reqs[i].m_Sector = phys;
+        reqs[i].m_Data = buf + off;
+        reqs[i].m_Count = run;
+        reqs[i].m_Done = [this, op, off, run](size_t done) {
+            if (done < run)
+                asyncFailed(op, off + done * SECTOR_SIZE);
+            completeAsync(op);
+        };
+        off += run * SECTOR_SIZE;
+    }
+    op->pending.fetch_add(count);
+    bool ok = m_asyncDev.m_Submit(reqs, count);
+    if (!ok)
+        for (size_t i = 0; i < count; i++)
+            reqs[i].m_Done(0);
+    delete[] reqs;
+    return ok;
+}
+
+bool CFileSystem::readFileAsync(int fd, void *data, size_t len, std::function<void(size_t)> done) {
+    if (fd < 0 || fd >= OPEN_FILES_MAX || !openedFiles[fd].openFLag)
+        return false;
+    if (!m_asyncDev.m_Submit) {
+        done(readFile(fd, data, len));
+        return true;
+    }
+    auto &tmpOpenFile = openedFiles[fd];
+    StartProgramFile &tmpSPF = *tmpOpenFile.fileStart;
+    std::unique_lock<std::shared_mutex> fileGuard(tmpSPF.lock);
+    if (tmpSPF.inlined) {
+        // nothing to queue, the data is in memory
+        fileGuard.unlock();
+        done(readFile(fd, data, len));
+        return true;
+    }
+
+    // queued reads go around the write buffers and the cache, the device has to be current
+    size_t pos = tmpOpenFile.tmpPos;
+    size_t n = pos < tmpSPF.size ? tmpSPF.size - pos : 0;
+    if (n > len)
+        n = len;
+    AsyncOp *op = beginAsync(n, std::move(done));
+    if (!flushWriteBuffers(&tmpSPF) || !flushCache(&tmpSPF)) {
+        asyncFailed(op, 0);
+        fileGuard.unlock();
+        completeAsync(op);
+        return true;
+    }
+    tmpOpenFile.tmpPos = pos + n;
+    tmpOpenFile.raNext = tmpOpenFile.tmpPos;
+
+    uint8_t *dst = static_cast<uint8_t *>(data);
+    size_t head = (SECTOR_SIZE - pos % SECTOR_SIZE) % SECTOR_SIZE;
+    if (head > n)
+        head = n;
+    size_t whole = (n - head) / SECTOR_SIZE * SECTOR_SIZE;
+    size_t tail = n - head - whole;
+
+    // partial head/tail sectors are read here, the whole sectors between them are queued
+    char sectorBuf[SECTOR_SIZE];
+    size_t run;
+    if (head && !cachedRead(physicalSector(tmpSPF, pos / SECTOR_SIZE, run), sectorBuf))
+        asyncFailed(op, 0);
+    else if (head)
+        memcpy(dst, sectorBuf + pos % SECTOR_SIZE, head);
+    if (tail && !cachedRead(physicalSector(tmpSPF, (pos + head + whole) / SECTOR_SIZE, run), sectorBuf))
+        asyncFailed(op, head + whole);
+    else if (tail)
+        memcpy(dst + head + whole, sectorBuf, tail);
+    queueRuns(op, tmpSPF, false, dst + head, pos + head, whole);
+    fileGuard.unlock();
+    completeAsync(op);
+    return true;
+}
+
+bool CFileSystem::writeFileAsync(int fd, const void *data, size_t len, std::function<void(size_t)> done) {
+    if (fd < 0 || fd >= OPEN_FILES_MAX || !openedFiles[fd].openFLag || !openedFiles[fd].writeFlag)
+        return false;
+    if (!m_asyncDev.m_Submit) {
+        done(writeFile(fd, data, len));
+        return true;
+    }
+    auto &tmpOpenFile = openedFiles[fd];
+    StartProgramFile &tmpSPF = *tmpOpenFile.fileStart;
+    std::unique_lock<std::shared_mutex> fileGuard(tmpSPF.lock);
+    const uint8_t *src = static_cast<const uint8_t *>(data);
+
+    // allocation, the gap past the end and the partial head/tail sectors are done synchronously
+    dropReadAhead(&tmpSPF);
+    if (tmpOpenFile.appendFlag)
+        tmpOpenFile.tmpPos = tmpSPF.size;
+    if (!tmpSPF.usedFlag || !moveOutOfInline(tmpOpenFile)) {
+        fileGuard.unlock();
+        done(0);
+        return true;
+    }
+    tmpOpenFile.modifiedFlag = true;
+    size_t pos = tmpOpenFile.tmpPos;
+    if (pos > tmpSPF.size)
+        writeLocked(fd, src, 0, pos);
+    size_t needSectors = (pos + len + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    if (pos > tmpSPF.size)
+        len = 0;
+    else if (needSectors > tmpSPF.sectorCount && !growFile(tmpSPF, needSectors, true, &tmpOpenFile.wbDelayed))
+        len = tmpSPF.sectorCount * SECTOR_SIZE > pos ? tmpSPF.sectorCount * SECTOR_SIZE - pos : 0;
+
+    size_t head = (SECTOR_SIZE - pos % SECTOR_SIZE) % SECTOR_SIZE;
+    if (head > len)
+        head = len;
+    size_t whole = (len - head) / SECTOR_SIZE * SECTOR_SIZE;
+    size_t tail = len - head - whole;
+    AsyncOp *op = beginAsync(len, std::move(done));
+    if (head && writeLocked(fd, src, head, pos) != head)
+        asyncFailed(op, 0);
+
+    // buffered sectors of the file would land on top of the queued data later
+    if (whole && !flushWriteBuffers(&tmpSPF))
+        asyncFailed(op, head);
+    else
+        queueRuns(op, tmpSPF, true, const_cast<uint8_t *>(src) + head, pos + head, whole);
+
+    // the queued sectors count as file data already, the tail must not zero-fill them as a gap
+    if (pos + head + whole > tmpSPF.size) {
+        tmpSPF.size = pos + head + whole;
+        markDirDirty(tmpSPF);
+    }
+    if (tail && writeLocked(fd, src + head + whole, tail, pos + head + whole) != tail)
+        asyncFailed(op, head + whole);
+    tmpOpenFile.tmpPos = pos + len;
+    fileGuard.unlock();
+    completeAsync(op);
+    return true;
+}
+
+//---------------------------------------------------------------------------
+FsUsageStats CFileSystem::usageStats() {
+    FsUsageStats st{0, 0, 0, 0, 0};
+    std::lock_guard<std::mutex> guard(m_dirMutex);
+    for (size_t i = 0; i < m_dirEntries; i++) {
+        if (!files[i].usedFlag)
+            continue;
+        std::lock_guard<std::shared_mutex> fileGuard(files[i].lock);
+        if (!ensureMapLoaded(files[i]))
+            continue;
+        st.files++;
+        st.extents += files[i].extentCount;
+    }
+
+    std::lock_guard<std::mutex> allocGuard(m_allocMutex);
+    for (size_t sec = findFree(0); sec < fSectorBitSize;) {
+        size_t run = freeRunLength(sec, fSectorBitSize);
+        st.freeSectors += run;
+        st.freeRuns++;
+        if (run > st.largestFreeRun)
+            st.largestFreeRun = run;
+        sec = findFree(sec + run);
+    }
+    return st;
+}
+
+//---------------------------------------------------------------------------
+size_t CFileSystem::viewFile(int fd, size_t offset, size_t len, const uint8_t *&view) {
+    if (!m_image || fd < 0 || fd >= OPEN_FILES_MAX || !openedFiles[fd].openFLag)
+        return 0;
+    StartProgramFile &tmpSPF = *openedFiles[fd].fileStart;
+    std::lock_guard<std::shared_mutex> fileGuard(tmpSPF.lock);
+    if (offset >= tmpSPF.size)
+        return 0;
+    if (tmpSPF.inlined) {
+        view = tmpSPF.inlineData + offset;
+        return len < tmpSPF.size - offset ? len : tmpSPF.size - offset;
+    }
+
+    // the image must hold what buffered and cached writes still keep in memory
+    if (!flushWriteBuffers(&tmpSPF) || !flushCache(&tmpSPF))
+        return 0;
+    size_t run;
+    uint32_t physSec = physicalSector(tmpSPF, offset / SECTOR_SIZE, run);
+    size_t avail = run * SECTOR_SIZE - offset % SECTOR_SIZE;
+    if (avail > tmpSPF.size - offset)
+        avail = tmpSPF.size - offset;
+    view = m_image + static_cast<size_t>(physSec) * SECTOR_SIZE + offset % SECTOR_SIZE;
+    return len < avail ? len : avail;
+}
+
+//---------------------------------------------------------------------------
+size_t CFileSystem::seekFile(int fd, int64_t offset, int whence) {
+    if (fd < 0 || fd >= OPEN_FILES_MAX || !openedFiles[fd].openFLag)
+        return SIZE_MAX;
+    auto &tmpOpenFile = openedFiles[fd];
+
+    int64_t base;
+    if (whence == SEEK_SET)
+        base = 0;
+    else if (whence == SEEK_CUR)
+        base = static_cast<int64_t>(tmpOpenFile.tmpPos);
+    else if (whence == SEEK_END) {
+        std::shared_lock<std::shared_mutex> fileGuard(tmpOpenFile.fileStart->lock);
+        base = static_cast<int64_t>(tmpOpenFile.fileStart->size);
+    }
+    else
+        return SIZE_MAX;
+    // range checks before the addition, base + offset could overflow
+    if (offset < -base || offset >= (int64_t) DEVICE_SIZE_MAX - base)
+        return SIZE_MAX;
+
+    tmpOpenFile.tmpPos = static_cast<size_t>(base + offset);
+    return tmpOpenFile.tmpPos;
+}
+
+size_t CFileSystem::preadFile(int fd, void *data, size_t len, size_t offset) {
+    if (fd < 0 || fd >= OPEN_FILES_MAX || !openedFiles[fd].openFLag)
+        return 0;
+    StartProgramFile &tmpSPF = *openedFiles[fd].fileStart;
+    std::shared_lock<std::shared_mutex> fileGuard(tmpSPF.lock, std::defer_lock);
+    if (!lockForRead(tmpSPF, fileGuard))
+        return 0;
+    return readLocked(tmpSPF, nullptr, static_cast<uint8_t *>(data), len, offset);
+}
+
+size_t CFileSystem::pwriteFile(int fd, const void *data, size_t len, size_t offset) {
+    if (fd < 0 || fd >= OPEN_FILES_MAX || !openedFiles[fd].openFLag || offset >= DEVICE_SIZE_MAX)
+        return 0;
+    std::lock_guard<std::shared_mutex> fileGuard(openedFiles[fd].fileStart->lock);
+    if (openedFiles[fd].appendFlag)
+        offset = openedFiles[fd].fileStart->size;
+    return writeLocked(fd, data, len, offset);
+}
+
+//---------------------------------------------------------------------------
+bool CFileSystem::truncateFile(int fd, size_t size) {
+    if (fd < 0 || fd >= OPEN_FILES_MAX || !openedFiles[fd].openFLag || !openedFiles[fd].writeFlag
+        || size >= DEVICE_SIZE_MAX)
+        return false;
+    // queued transfers may still target sectors past the new end
+    waitAsync();
+    auto &tmpOpenFile = openedFiles[fd];
+    StartProgramFile &tmpSPF = *tmpOpenFile.fileStart;
+    std::lock_guard<std::shared_mutex> fileGuard(tmpSPF.lock);
+    if (!tmpSPF.usedFlag)
+        return false;
+    if (size > tmpSPF.size) {
+        writeLocked(fd, nullptr, 0, size);
+        return tmpSPF.size == size;
+    }
+
+    size_t keep = (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    tmpOpenFile.modifiedFlag = true;
+    clipWriteBuffers(&tmpSPF, keep);
+    dropReadAhead(&tmpSPF);
+    trimExtents(tmpSPF, keep);
+    if (tmpSPF.inlined)
+        memset(tmpSPF.inlineData + size, 0, INLINE_DATA_MAX - size);
+    if (tmpSPF.size != size) {
+        tmpSPF.size = size;
+        markDirDirty(tmpSPF);
+    }
+    return true;
+}
+
 //---------------------------------------------------------------------------
 bool CFileSystem::deleteFile(const char *fileName) {
+    std::lock_guard<std::mutex> guard(m_dirMutex);
     int idx = findFileID(fileName);
     if (idx < 0)
         return false;
+    std::lock_guard<std::shared_mutex> fileGuard(files[idx].lock);
+    if (!ensureMapLoaded(files[idx]))
+        return false;
 
-    for (size_t i = 0; i < files[idx].sectorCount; ++i)
-        fSectorBit[files[idx].sectorsArray[i]] = false;
+    dropReadAhead(&files[idx]);
+    dropWriteBuffers(&files[idx]);
+    freeExtents(files[idx]);
 
-    freeIBChain(files[idx].rootIB);
+    freeIndexBlocks(files[idx], 0);
+    markDirDirty(files[idx]);
 
+    indexErase(idx);
+    if (files[idx].fdMask) {
+        // descriptors still point at the slot: the name is gone now, the slot is freed by the last closeFile
+        files[idx].usedFlag = false;
+        files[idx].size = 0;
+        files[idx].inlined = false;
+        return true;
+    }
     files[idx] = StartProgramFile{};
+    m_freeSlots[m_freeCount++] = idx;
     return true;
 }
 
 //---------------------------------------------------------------------------
 bool CFileSystem::findFirst(TFile &file) {
-    findfPosition = 0;
+    {
+        std::lock_guard<std::mutex> guard(m_dirMutex);
+        findfPosition = 0;
+    }
     return findNext(file);
 }
 
 bool CFileSystem::findNext(TFile &file) {
-    while (findfPosition < DIR_ENTRIES_MAX && !files[findfPosition].usedFlag)
+    std::lock_guard<std::mutex> guard(m_dirMutex);
+    while (findfPosition < m_dirEntries && !files[findfPosition].usedFlag)
         findfPosition++;
-    if (findfPosition >= DIR_ENTRIES_MAX)
+    if (findfPosition >= m_dirEntries)
         return false;
     strncpy(file.m_FileName, files[findfPosition].name, FILENAME_LEN_MAX);
     file.m_FileName[FILENAME_LEN_MAX] = '\0';
 
+    std::shared_lock<std::shared_mutex> fileGuard(files[findfPosition].lock);
     file.m_FileSize = files[findfPosition].size;
     findfPosition++;
 
@@ -502,19 +2750,77 @@ bool CFileSystem::findNext(TFile &file) {
 
 //---------------------------------------------------------------------------
 int CFileSystem::findFileID(const char *fileName) {
-    for (int i = 0; i < DIR_ENTRIES_MAX; i++) {
-        if (files[i].usedFlag && strcmp(files[i].name, fileName) == 0)
+    for (size_t h = nameHash(fileName) & m_nameIndexMask;; h = (h + 1) & m_nameIndexMask) {
+        int i = m_nameIndex[h];
+        if (i < 0)
+            return -1;
+        if (strcmp(files[i].name, fileName) == 0)
             return i;
     }
-    return -1;
 }
 
 int CFileSystem::firstFreePosInput() {
-    for (int i = 0; i < DIR_ENTRIES_MAX; i++) {
-        if (!files[i].usedFlag)
-            return i;
+    if (!m_freeCount)
+        return -1;
+    return m_freeSlots[--m_freeCount];
+}
+
+// FNV-1a over the file name (names are at most FILENAME_LEN_MAX characters)
+size_t CFileSystem::nameHash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < FILENAME_LEN_MAX && name[i]; i++) {
+        h ^= static_cast<uint8_t>(name[i]);
+        h *= 16777619u;
     }
-    return -1;
+    return h;
+}
+
+void CFileSystem::indexInsert(int slot) {
+    size_t h = nameHash(files[slot].name) & m_nameIndexMask;
+    while (m_nameIndex[h] >= 0)
+        h = (h + 1) & m_nameIndexMask;
+    m_nameIndex[h] = slot;
+}
+
+// removes the slot and shifts the rest of its probe run back, so lookups need no tombstones
+void CFileSystem::indexErase(int slot) {
+    size_t h = nameHash(files[slot].name) & m_nameIndexMask;
+    while (m_nameIndex[h] != slot)
+        h = (h + 1) & m_nameIndexMask;
+
+    size_t hole = h;
+    for (size_t j = (hole + 1) & m_nameIndexMask; m_nameIndex[j] >= 0; j = (j + 1) & m_nameIndexMask) {
+        size_t home = nameHash(files[m_nameIndex[j]].name) & m_nameIndexMask;
+        // move the entry into the hole unless its home lies cyclically in (hole, j]
+        if (((j - home) & m_nameIndexMask) >= ((j - hole) & m_nameIndexMask)) {
+            m_nameIndex[hole] = m_nameIndex[j];
+            hole = j;
+        }
+    }
+    m_nameIndex[hole] = -1;
+}
+
+void CFileSystem::rebuildDirIndex() {
+    for (size_t i = 0; i <= m_nameIndexMask; i++)
+        m_nameIndex[i] = -1;
+    m_freeCount = 0;
+    for (size_t i = m_dirEntries; i-- > 0;) {
+        if (files[i].usedFlag)
+            indexInsert((int)i);
+        else
+            m_freeSlots[m_freeCount++] = (int)i;
+    }
+}
+
+// the directory grows with the device: one slot per SECTORS_PER_DIR_ENTRY sectors, at least
+// DIR_ENTRIES_MAX, rounded up to whole sectors
+size_t CFileSystem::dirSectorsFor(size_t sectors) {
+    size_t entries = sectors / SECTORS_PER_DIR_ENTRY;
+    if (entries < DIR_ENTRIES_MAX)
+        entries = DIR_ENTRIES_MAX;
+    if (entries > DIR_ENTRIES_LIMIT)
+        entries = DIR_ENTRIES_LIMIT;
+    return (entries + REC_PER_SEC - 1) / REC_PER_SEC;
 }
 
 int CFileSystem::firstFreeOpenFile() {
@@ -526,179 +2832,233 @@ int CFileSystem::firstFreeOpenFile() {
 }
 
 
+// writes back only what changed since the last save: extent blocks of modified files, dirty
+// directory sectors, the header and dirty bitmap sectors (last, in runs of adjacent sectors)
 bool CFileSystem::saveFile() {
-    const uint32_t REC_PER_SEC = SECTOR_SIZE / sizeof ( InputFileDir );
-    const uint32_t direcSec    = (DIR_ENTRIES_MAX + REC_PER_SEC - 1) / REC_PER_SEC;
-    const uint32_t bmSec = (fSectorBitSize + SECTOR_SIZE - 1) / SECTOR_SIZE;
-    const uint32_t bitMapStart = 1 + direcSec;
-
-    char headSec[SECTOR_SIZE]{};
-    auto &hdr = *reinterpret_cast<FileSysHead *>( headSec );
-    strncpy(hdr.sysVar, "MYFS000", 7);
-    hdr.filesOccupied = direcSec;
-    hdr.fileSecOcc = bmSec;
-    if (!checkWriteMethod(0, headSec))
-        return false;
-
-    char dirSec[SECTOR_SIZE]{};
-    InputFileDir *d = reinterpret_cast<InputFileDir *>( dirSec );
+    const uint32_t bmSec = bitmapSectors(fSectorBitSize);
+    const uint32_t bitMapStart = 1 + m_dirSectors;
 
-    for (int fi = 0; fi < DIR_ENTRIES_MAX; ++fi) {
-        int secOfs = fi / REC_PER_SEC;
-        int recOfs = fi % REC_PER_SEC;
-
-        if (recOfs == 0)
-            memset(dirSec, 0, SECTOR_SIZE);
-
-        InputFileDir &de = d[recOfs];
-        de.mainIndBlock = 0xFFFFFFFF;
-
-        if (files[fi].usedFlag) {
-            strncpy(de.name, files[fi].name, FILENAME_LEN_MAX);
-            de.name[FILENAME_LEN_MAX] = '\0';
-            de.size = files[fi].size > 0xFFFFFFFFu ? 0xFFFFFFFFu : static_cast<uint32_t>( files[fi].size );
-            de.usedFlag = 1;
-
-            size_t pos = 0;
-            uint32_t prev = 0xFFFFFFFF;
-
-            while (pos < files[fi].sectorCount) {
-                uint32_t ibSec;
-                if (!findAllocFreeSec(ibSec))
-                    return false;
+    for (size_t fi = 0; fi < m_dirEntries; ++fi)
+        if (files[fi].usedFlag && files[fi].mapLoaded && !saveIndexBlocks(files[fi]))
+            return false;
 
-                if (de.mainIndBlock == 0xFFFFFFFF)
-                    de.mainIndBlock = ibSec;
+    if (m_headDirty) {
+        char headSec[SECTOR_SIZE]{};
+        auto &hdr = *reinterpret_cast<FileSysHead *>( headSec );
+        strncpy(hdr.sysVar, FS_MAGIC, 7);
+        hdr.filesOccupied = m_dirSectors;
+        hdr.fileSecOcc = bmSec;
+        if (!cachedWrite(0, headSec))
+            return false;
+        m_headDirty = false;
+    }
 
-                char ibBuf[SECTOR_SIZE]{};
-                auto &ib = *reinterpret_cast<fileBlockID *>(ibBuf);
+    if (!flushCache())
+        return false;
 
-                size_t fill = 0;
-                while (fill < 127 && pos < files[fi].sectorCount)
-                    ib.tmpID[fill++] = static_cast<uint32_t>( files[fi].sectorsArray[pos++] );
+    // dirty directory sectors go straight to the device in runs of up to DIR_IO_SECTORS
+    char *dirBuf = new char[DIR_IO_SECTORS * SECTOR_SIZE];
+    for (size_t sec = 0; sec < m_dirSectors;) {
+        if (!m_dirDirty[sec]) {
+            sec++;
+            continue;
+        }
+        size_t run = 0;
+        while (sec + run < m_dirSectors && run < DIR_IO_SECTORS && m_dirDirty[sec + run]) {
+            m_dirDirty[sec + run].store(0);
+            buildDirSector((int)(sec + run), dirBuf + run * SECTOR_SIZE);
+            run++;
+        }
+        if (!checkWriteMethod(1 + sec, dirBuf, run)) {
+            delete[] dirBuf;
+            return false;
+        }
+        cacheInvalidate(1 + sec, run);
+        sec += run;
+    }
+    delete[] dirBuf;
 
-                ib.nextBlock = 0xFFFFFFFF;
+    for (uint32_t sec = 0; sec < bmSec;) {
+        if (!m_bmDirty[sec]) {
+            sec++;
+            continue;
+        }
+        uint32_t run = 1;
+        while (sec + run < bmSec && m_bmDirty[sec + run])
+            run++;
+        const char *src = reinterpret_cast<const char *>( fSectorBit ) + (size_t)sec * SECTOR_SIZE;
+        if (!checkWriteMethod(bitMapStart + sec, src, run))
+            return false;
+        cacheInvalidate(bitMapStart + sec, run);
+        memset(m_bmDirty + sec, 0, run);
+        sec += run;
+    }
 
-                if (prev != 0xFFFFFFFF) {
-                    char prevBuf[SECTOR_SIZE];
-                    if (!checkReadMethod(prev, prevBuf))
-                        return false;
-                    reinterpret_cast<fileBlockID *>( prevBuf )->nextBlock = ibSec;
-                    if (!checkWriteMethod(prev, prevBuf))
-                        return false;
-                }
-                prev = ibSec;
+    return true;
+}
 
-                if (!checkWriteMethod(ibSec, ibBuf))
-                    return false;
-            }
-        }
+bool CFileSystem::appendLoadedExtents(StartProgramFile &f, const FileExtent *ext, size_t count) {
+    for (size_t k = 0; k < count; ++k) {
+        if (ext[k].start + (size_t)ext[k].length > fSectorBitSize)
+            return false;
+        appendExtent(f, ext[k].start, ext[k].length);
+    }
+    return true;
+}
 
-        if (recOfs == REC_PER_SEC - 1)
-            if (!checkWriteMethod(1 + secOfs, dirSec))
+// reads the pointer block at sec (`level` levels above the leaves, first leaf firstLeaf) and everything below
+// it; the leaves under one pointer block are read with one device call per adjacent run
+bool CFileSystem::loadPointerBlock(StartProgramFile &f, uint32_t sec, int level, size_t firstLeaf, size_t leaves,
+                                   char *leafBuf) {
+    PointerBlock pb;
+    if (sec >= fSectorBitSize || !cachedRead(sec, &pb))
+        return false;
+    pushPointerBlock(f, sec);
+    size_t count = pointerChildren(level, firstLeaf, leaves);
+    if (level > 1) {
+        for (size_t k = 0; k < count; ++k)
+            if (!loadPointerBlock(f, pb.blocks[k], level - 1, firstLeaf + k * leavesUnder(level - 1), leaves, leafBuf))
                 return false;
+        return true;
     }
 
-
-    for (uint32_t i = 0; i < bitMapStart + bmSec && i < fSectorBitSize; ++i)
-        fSectorBit[i] = true;
-
-    char bmpSec[SECTOR_SIZE]{};
-    size_t cur = 0;
-    for (uint32_t s = 0; s < bmSec; ++s) {
-        for (size_t i = 0; i < SECTOR_SIZE && cur < fSectorBitSize; ++i, ++cur)
-            bmpSec[i] = fSectorBit[cur] ? 1 : 0;
-        if (!checkWriteMethod(bitMapStart + s, bmpSec))
+    for (size_t k = 0; k < count;) {
+        size_t run = 1;
+        while (k + run < count && pb.blocks[k + run] == pb.blocks[k] + run)
+            run++;
+        if (pb.blocks[k] + run > fSectorBitSize || !checkReadMethod(pb.blocks[k], leafBuf, run))
             return false;
-        memset(bmpSec, 0, SECTOR_SIZE);
+        cacheOverlay(pb.blocks[k], leafBuf, run);
+        for (size_t j = 0; j < run; ++j) {
+            const auto &ib = *reinterpret_cast<const ExtentBlock *>( leafBuf + j * SECTOR_SIZE );
+            pushIndexBlock(f, pb.blocks[k + j]);
+            if (ib.extentCount > EXTENTS_PER_BLOCK || !appendLoadedExtents(f, ib.extents, ib.extentCount))
+                return false;
+        }
+        k += run;
     }
+    return true;
+}
 
-    int lastSec = direcSec - 1;
-    int lastRec = DIR_ENTRIES_MAX % REC_PER_SEC;
+// reads the file's index tree rooted at f.rootIB into its extent list: the root, the single-indirect
+// block and the pointer trees with their leaves; the sectors are already marked in the bitmap stored on disk
+bool CFileSystem::loadIndexTree(StartProgramFile &f) {
+    f.extentCount = 0;
+    f.sectorCount = 0;
+    f.ibCount = 0;
+    f.ptrCount = 0;
+    if (f.rootIB != 0xFFFFFFFF) {
+        char buf[SECTOR_SIZE];
+        if (f.rootIB >= fSectorBitSize || !cachedRead(f.rootIB, buf))
+            return false;
+        const IndexRoot root = *reinterpret_cast<const IndexRoot *>( buf );
+        size_t total = root.extentCount;
+        if (total > MAX_FILE_EXTENTS)
+            return false;
+        pushIndexBlock(f, f.rootIB);
+        if (!appendLoadedExtents(f, root.extents, total < ROOT_EXTENTS ? total : ROOT_EXTENTS))
+            return false;
 
-    if (lastRec) {
-        memset(dirSec + lastRec * sizeof(InputFileDir), 0, SECTOR_SIZE - lastRec * sizeof(InputFileDir));
+        size_t blocks = total ? indexBlockOf(total - 1) : 0;     // extent blocks below the root
+        if (blocks >= 1) {
+            if (root.indirect >= fSectorBitSize || !cachedRead(root.indirect, buf))
+                return false;
+            pushIndexBlock(f, root.indirect);
+            const auto &ib = *reinterpret_cast<const ExtentBlock *>( buf );
+            if (ib.extentCount > EXTENTS_PER_BLOCK || !appendLoadedExtents(f, ib.extents, ib.extentCount))
+                return false;
+        }
 
-        if (!checkWriteMethod(1 + lastSec, dirSec))
+        size_t leaves = blocks > 1 ? blocks - 1 : 0;
+        const uint32_t tops[INDIRECT_TREES] = {root.doubleIndirect, root.tripleIndirect, root.quadIndirect};
+        char *leafBuf = new char[POINTERS_PER_BLOCK * SECTOR_SIZE];
+        bool ok = true;
+        size_t firstLeaf = 0;
+        for (int t = 0; ok && t < INDIRECT_TREES && firstLeaf < leaves; firstLeaf += leavesUnder(t + 1), ++t)
+            ok = loadPointerBlock(f, tops[t], t + 1, firstLeaf, leaves, leafBuf);
+        delete[] leafBuf;
+        if (!ok)
             return false;
     }
-
-
+    f.dirtyExtent = SIZE_MAX;
+    f.mapLoaded = true;
     return true;
 }
 
 bool CFileSystem::loadFile() {
     char headSec[SECTOR_SIZE];
-    if (!checkReadMethod(0, headSec))
+    if (!cachedRead(0, headSec))
         return false;
     const auto &hdr = *reinterpret_cast<const FileSysHead *>( headSec );
-    if (strncmp(hdr.sysVar, "MYFS000", 7))
+    if (strncmp(hdr.sysVar, FS_MAGIC, 7))
         return false;
 
-    const uint32_t REC_PER_SEC = SECTOR_SIZE / sizeof ( InputFileDir );
-    const uint32_t direcSec    = (DIR_ENTRIES_MAX + REC_PER_SEC - 1) / REC_PER_SEC;
+    if (hdr.filesOccupied != m_dirSectors)
+        return false;
     const uint32_t bmSec = hdr.fileSecOcc;
-    const uint32_t bitMapStart = 1 + direcSec;
-
-    char dirSec[SECTOR_SIZE];
-    for (int sec = 0, fi = 0; sec < static_cast<int>( direcSec ); ++sec) {
-        if (!checkReadMethod(1 + sec, dirSec))
-            return false;
-        const InputFileDir *d = reinterpret_cast<const InputFileDir *>( dirSec );
-
-        for (int rec = 0; rec < (int)REC_PER_SEC && fi < DIR_ENTRIES_MAX; ++rec, ++fi) {
-            files[fi] = StartProgramFile{};
-            if (!d[rec].usedFlag)
+    const uint32_t bitMapStart = 1 + m_dirSectors;
+
+    char *dirBuf = new char[DIR_IO_SECTORS * SECTOR_SIZE];
+    bool dirOk = true;
+    for (size_t chunk = 0; chunk < m_dirSectors; chunk += DIR_IO_SECTORS) {
+        size_t run = m_dirSectors - chunk < DIR_IO_SECTORS ? m_dirSectors - chunk : DIR_IO_SECTORS;
+        if (!checkReadMethod(1 + chunk, dirBuf, run)) {
+            dirOk = false;
+            break;
+        }
+        for (size_t rec = 0; rec < run * REC_PER_SEC; ++rec) {
+            const InputFileDir &de = reinterpret_cast<const InputFileDir *>(
+                    dirBuf + rec / REC_PER_SEC * SECTOR_SIZE )[rec % REC_PER_SEC];
+            if (!de.usedFlag)
                 continue;
 
-            strncpy(files[fi].name, d[rec].name, FILENAME_LEN_MAX);
-            files[fi].name[FILENAME_LEN_MAX] = '\0';
-            files[fi].size = (d[rec].size == 0xFFFFFFFFu) ? static_cast<size_t>( SIZE_MAX )
-                                                          : static_cast<size_t>(d[rec].size);
-
-            files[fi].usedFlag = true;
-            files[fi].rootIB = d[rec].mainIndBlock;
-
-            uint32_t ibSec = d[rec].mainIndBlock;
-            while (ibSec != 0xFFFFFFFF) {
-                if (ibSec < fSectorBitSize)
-                    fSectorBit[ibSec] = true;
-
-                char ibBuf[SECTOR_SIZE];
-                if (!checkReadMethod(ibSec, ibBuf))
-                    return false;
-                const auto &ib = *reinterpret_cast<const fileBlockID *>( ibBuf );
-
-                for (int k = 0; k < 127 && ib.tmpID[k]; ++k) {
-                    uint32_t ds = ib.tmpID[k];
-                    if (ds < fSectorBitSize)
-                        fSectorBit[ds] = true;
-
-                    secArrSearchSpace(files[fi], 1);
-                    files[fi].sectorsArray[files[fi].sectorCount++] = ds;
-                }
-                ibSec = ib.nextBlock;
+            StartProgramFile &f = files[chunk * REC_PER_SEC + rec];
+            strncpy(f.name, de.name, FILENAME_LEN_MAX);
+            f.name[FILENAME_LEN_MAX] = '\0';
+            f.size = (de.size == 0xFFFFFFFFu) ? static_cast<size_t>( SIZE_MAX ) : static_cast<size_t>(de.size);
+            f.usedFlag = true;
+            f.rootIB = de.mainIndBlock;
+            f.mapLoaded = false;
+            if (de.inlineFlag && f.size <= INLINE_DATA_MAX) {
+                f.inlined = true;
+                memcpy(f.inlineData, de.inlineData, f.size);
+                f.mapLoaded = true;
             }
         }
     }
+    delete[] dirBuf;
+    if (!dirOk)
+        return false;
+    rebuildDirIndex();
 
-    char bmpSec[SECTOR_SIZE];
-    size_t cur = 0;
-    for (uint32_t s = 0; s < bmSec; ++s) {
-        if (!checkReadMethod(bitMapStart + s, bmpSec))
-            return false;
-        for (size_t i = 0; i < SECTOR_SIZE && cur < fSectorBitSize; ++i, ++cur)
-            fSectorBit[cur] = fSectorBit[cur] || bmpSec[i];
+    if (bmSec != bitmapSectors(fSectorBitSize))
+        return false;
+    uint64_t *diskBits = new uint64_t[fBitWords];
+    bool bmOk = checkReadMethod(bitMapStart, diskBits, bmSec);
+    for (size_t w = 0; bmOk && w < fBitWords; ++w) {
+        fSectorBit[w] |= diskBits[w];
+        updateSummary(w);
     }
-    for (size_t i = 0; i < bitMapStart + bmSec && i < fSectorBitSize; ++i)
-        fSectorBit[i] = true;
+    m_freeSectors = 0;
+    for (size_t w = 0; w < fBitWords; ++w)
+        m_freeSectors += 64 - std::popcount(fSectorBit[w]);
+    rebuildRunIndex();
+    delete[] diskBits;
+    if (!bmOk)
+        return false;
+
+    // everything in memory now matches the disk
+    m_headDirty = false;
+    for (size_t i = 0; i < m_dirSectors; i++)
+        m_dirDirty[i].store(0);
+    memset(m_bmDirty, 0, bmSec);
 
     m_nextFree = bitMapStart + bmSec;
     return true;
 }
 
 
-#ifndef __PROGTEST__
+#if !defined(__PROGTEST__) && !defined(FS_BENCHMARK)
 
 #include "simple_test.inc"
 
@@ -0,0 +1,134 @@
+/* Offline analysis of device traces written by CInstrumentedBlkDev (e.g. fsbench -t).
+ *
+ * Prints per direction: calls, sectors, request-size histogram, latency percentiles and how many calls
+ * continue the previous one (sequential), land close behind it (near, <= NEAR_SECTORS ahead) or
+ * elsewhere (random). A heatmap splits the device into equal slices and shows how many sectors were
+ * read/written in each one, followed by the hottest individual sectors.
+ *
+ * usage: fstrace trace.bin [heatmap rows]
+ */
+#define FS_BENCHMARK
+
+#include "main.cpp"
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+static constexpr uint32_t NEAR_SECTORS = 64;
+static constexpr int SIZE_BUCKETS = 16;      // bucket b: requests of [2^b, 2^(b+1)) sectors
+static constexpr size_t HOT_SECTORS = 10;
+
+struct TDirSummary {
+    size_t m_Calls = 0;
+    size_t m_Sectors = 0;
+    size_t m_Sequential = 0;
+    size_t m_Near = 0;
+    size_t m_Sizes[SIZE_BUCKETS] = {};
+    std::vector<uint32_t> m_Latency;
+    uint64_t m_NextSector = UINT64_MAX;
+};
+
+static bool loadTrace(const char *path, BlkTraceHeader &head, std::vector<BlkTraceRecord> &recs) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+    bool ok = fread(&head, sizeof(head), 1, fp) == 1 && !strncmp(head.magic, BLK_TRACE_MAGIC, sizeof(head.magic));
+    BlkTraceRecord buf[4096];
+    size_t n;
+    while (ok && (n = fread(buf, sizeof(BlkTraceRecord), 4096, fp)) > 0)
+        recs.insert(recs.end(), buf, buf + n);
+    fclose(fp);
+    return ok;
+}
+
+static void printDirection(const char *name, TDirSummary &d) {
+    printf("%s: %zu calls, %zu sectors (%.1f per call)\n", name, d.m_Calls, d.m_Sectors,
+           d.m_Calls ? double(d.m_Sectors) / d.m_Calls : 0.0);
+    if (!d.m_Calls)
+        return;
+    printf("  sequential %5.1f %%   near %5.1f %%   random %5.1f %%\n", 100.0 * d.m_Sequential / d.m_Calls,
+           100.0 * d.m_Near / d.m_Calls, 100.0 * (d.m_Calls - d.m_Sequential - d.m_Near) / d.m_Calls);
+
+    std::sort(d.m_Latency.begin(), d.m_Latency.end());
+    auto pct = [&d](double p) { return d.m_Latency[static_cast<size_t>(p * (d.m_Latency.size() - 1))]; };
+    printf("  latency ns: p50 %u  p90 %u  p99 %u  max %u\n", pct(0.5), pct(0.9), pct(0.99), d.m_Latency.back());
+
+    printf("  request size (sectors):");
+    for (int b = 0; b < SIZE_BUCKETS; b++)
+        if (d.m_Sizes[b])
+            printf("  %u+: %zu", 1u << b, d.m_Sizes[b]);
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace.bin [heatmap rows]\n", argv[0]);
+        return 2;
+    }
+    size_t rows = argc > 2 ? strtoul(argv[2], nullptr, 10) : 32;
+    if (!rows)
+        rows = 32;
+
+    BlkTraceHeader head;
+    std::vector<BlkTraceRecord> recs;
+    if (!loadTrace(argv[1], head, recs)) {
+        fprintf(stderr, "%s: not a device trace\n", argv[1]);
+        return 1;
+    }
+
+    TDirSummary dirs[2];
+    std::vector<size_t> heat[2] = {std::vector<size_t>(rows), std::vector<size_t>(rows)};
+    std::unordered_map<uint32_t, size_t> perSector;
+    uint64_t sliceSectors = (head.sectors + rows - 1) / rows;
+    for (const BlkTraceRecord &r : recs) {
+        TDirSummary &d = dirs[r.write ? 1 : 0];
+        d.m_Calls++;
+        d.m_Sectors += r.count;
+        d.m_Latency.push_back(r.latencyNs);
+        if (r.sector == d.m_NextSector)
+            d.m_Sequential++;
+        else if (d.m_NextSector != UINT64_MAX && r.sector > d.m_NextSector && r.sector - d.m_NextSector <= NEAR_SECTORS)
+            d.m_Near++;
+        d.m_NextSector = uint64_t(r.sector) + r.count;
+        int b = r.count ? std::bit_width(r.count) - 1 : 0;
+        d.m_Sizes[b < SIZE_BUCKETS ? b : SIZE_BUCKETS - 1]++;
+
+        // a call spanning several slices is split between them
+        for (uint64_t sec = r.sector; sec < uint64_t(r.sector) + r.count;) {
+            size_t slice = sec / sliceSectors;
+            uint64_t end = std::min<uint64_t>((slice + 1) * sliceSectors, uint64_t(r.sector) + r.count);
+            if (slice < rows)
+                heat[r.write ? 1 : 0][slice] += end - sec;
+            sec = end;
+        }
+        for (uint32_t i = 0; i < r.count; i++)
+            perSector[r.sector + i]++;
+    }
+
+    double span = recs.empty() ? 0 : (recs.back().timeNs + recs.back().latencyNs - recs.front().timeNs) / 1e9;
+    printf("%zu calls over %.3f s on a %llu-sector device\n", recs.size(), span, (unsigned long long) head.sectors);
+    printDirection("read", dirs[0]);
+    printDirection("write", dirs[1]);
+
+    size_t peak = 1;
+    for (size_t i = 0; i < rows; i++)
+        peak = std::max(peak, heat[0][i] + heat[1][i]);
+    printf("\nheatmap (%llu sectors per row, R = read, W = written)\n", (unsigned long long) sliceSectors);
+    for (size_t i = 0; i < rows; i++) {
+        int rd = static_cast<int>(50 * heat[0][i] / peak), wr = static_cast<int>(50 * heat[1][i] / peak);
+        printf("  %10llu %10zu %10zu |%s%s\n", (unsigned long long) (i * sliceSectors), heat[0][i], heat[1][i],
+               std::string(rd, 'R').c_str(), std::string(wr, 'W').c_str());
+    }
+
+    std::vector<std::pair<uint32_t, size_t>> hot(perSector.begin(), perSector.end());
+    size_t top = std::min(HOT_SECTORS, hot.size());
+    std::partial_sort(hot.begin(), hot.begin() + top, hot.end(), [](const auto &a, const auto &b) {
+        return a.second > b.second || (a.second == b.second && a.first < b.first);
+    });
+    printf("\nhottest sectors:");
+    for (size_t i = 0; i < top; i++)
+        printf("  %u (%zu)", hot[i].first, hot[i].second);
+    printf("\n");
+    return 0;
+}